@@ -0,0 +1,17 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 fragTexCoord;
+in vec3 fragColor;
+
+// output data
+out vec4 color;
+
+// Glyph atlas - coverage of every glyph in the red channel
+uniform sampler2D glyphAtlas;
+
+void main()
+{
+    // Output color = text color, blended by how much of the pixel the glyph covers
+    color = vec4(fragColor, texture(glyphAtlas, fragTexCoord).r);
+}
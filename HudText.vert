@@ -0,0 +1,22 @@
+#version 330 core
+
+// input data : one quad per glyph, in pixels from the top left of the window - shorts and normalized integers
+layout (location = 0) in vec2 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+layout (location = 2) in vec2 vertexTexCoord;
+
+uniform vec2 screenSize; // framebuffer size in pixels
+
+// output data : used by fragment shader
+out vec2 fragTexCoord;
+out vec3 fragColor;
+
+void main ()
+{
+    fragTexCoord = vertexTexCoord;
+    fragColor = vertexColor;
+
+    // Pixels to clip space - y grows downwards on the screen
+    vec2 ndc = vertexPosition / screenSize * 2.0 - 1.0;
+    gl_Position = vec4(ndc.x, -ndc.y, 0, 1);
+}
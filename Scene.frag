@@ -0,0 +1,28 @@
+#version 330 core
+
+// Variants are chosen by the same defines as Scene.vert
+
+// Interpolated values from the vertex shaders
+#ifdef TEXTURED
+in vec2 fragTexCoord;
+flat in int fragLayer;
+
+// Texture array holding every material
+uniform sampler2DArray texSampler;
+#else
+in vec3 fragColor;
+#endif
+
+// output data
+out vec3 color;
+
+void main()
+{
+    // Output color = color from texture sample or from the vertex shader,
+    // interpolated between all 3 surrounding vertices of the triangle
+#ifdef TEXTURED
+    color = texture( texSampler, vec3(fragTexCoord, fragLayer) ).rgb;
+#else
+    color = fragColor;
+#endif
+}
@@ -0,0 +1,85 @@
+#version 330 core
+
+// Every scene object is drawn by a variant of this shader - game.cpp puts the defines of the
+// features a draw needs right after the version line (see sceneProgram)
+//   TEXTURED  : texture coords and the material array, else vertex colors
+//   OBJECT    : model matrix and material layer from the Object block, else world space with
+//               the layer in attribute 5
+//   INSTANCED : one board tile per instance, moved by attribute 3
+//   ANIMATED  : instances jump, attribute 4 - only with INSTANCED
+//   JUMP_HEIGHT is defined by game.cpp as well
+
+// input data : sent from main program - packed types, GL widens them to float
+layout (location = 0) in vec3 vertexPosition;
+#ifdef TEXTURED
+layout (location = 2) in vec2 vertexTexCoord;
+#else
+layout (location = 1) in vec3 vertexColor;
+#endif
+#ifndef OBJECT
+layout (location = 5) in float vertexLayer; // per vertex, or per instance with INSTANCED
+#endif
+#ifdef INSTANCED
+layout (location = 3) in vec3 instanceOffset;
+#endif
+#ifdef ANIMATED
+layout (location = 4) in vec2 instanceJump; // starting height, speed
+#endif
+
+// camera : shared by every program, updated once per frame
+layout (std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    mat4 VP;
+    float time;
+};
+
+#ifdef OBJECT
+// object : written to the upload ring once per draw
+layout (std140) uniform Object {
+    mat4 model;
+    vec3 objectColor;
+    int texLayer;
+};
+#endif
+
+// output data : used by fragment shader
+#ifdef TEXTURED
+out vec2 fragTexCoord;
+flat out int fragLayer;
+#else
+out vec3 fragColor;
+#endif
+
+void main ()
+{
+    vec3 position = vertexPosition;
+#ifdef INSTANCED
+    // Move the shared tile mesh to this tile's place on the board
+    position += instanceOffset;
+#endif
+#ifdef ANIMATED
+    // Height of a jumping tile at this time - still tiles have no speed
+    position.y += mod(instanceJump.x + time * instanceJump.y, JUMP_HEIGHT);
+#endif
+
+#ifdef TEXTURED
+    // The texture coord of each vertex will be interpolated
+    // to produce the color of each fragment
+    fragTexCoord = vertexTexCoord;
+#ifdef OBJECT
+    fragLayer = texLayer;
+#else
+    fragLayer = int(vertexLayer + 0.5);
+#endif
+#else
+    fragColor = vertexColor;
+#endif
+
+    // Output position of the vertex, in clip space : VP * model * position
+#ifdef OBJECT
+    gl_Position = VP * model * vec4(position, 1);
+#else
+    gl_Position = VP * vec4(position, 1);
+#endif
+}
@@ -1,17 +1,34 @@
 #version 330 core
 
-uniform mat4 MVP;
+// camera : shared by every program, updated once per frame
+layout (std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    mat4 VP;
+    float time;
+};
+
+// object : written to the upload ring once per draw
+layout (std140) uniform Object {
+    mat4 model;
+    vec3 objectColor;
+    int texLayer;
+};
 uniform vec3 pen;
-uniform vec3 fontColor;
 
-in vec3 vertexPosition;
-in vec3 vertexNormal;
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexNormal;
 
 out vec3 fragColor;
+// the string in its own space : captured once by transform feedback for the text cache
+out vec3 capturedPosition;
+out vec3 capturedNormal;
 
 void main ()
 {
-    gl_Position = MVP * (vec4(vertexPosition, 1.0) + vec4(pen, 1.0));
+    gl_Position = VP * model * (vec4(vertexPosition, 1.0) + vec4(pen, 1.0));
     // fragColor = vec3((vertexNormal.x+1)/2,(vertexNormal.y+1)/2,(vertexNormal.z+1)/2);
-    fragColor = fontColor;
-}
\ No newline at end of file
+    fragColor = objectColor;
+    capturedPosition = vertexPosition + pen;
+    capturedNormal = vertexNormal;
+}
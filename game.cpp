@@ -2,6 +2,29 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <list>
+#include <string>
+#include <tuple>
+#include <cstddef>
+#include <cstdio>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <dirent.h>
+#include <cstring>
+#include <limits>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
@@ -10,131 +33,926 @@
 
 #include <glad/glad.h>
 #include <FTGL/ftgl.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
 #include <GLFW/glfw3.h>
 #include <SOIL/SOIL.h>
 
 using namespace std;
-int cube_key=0;
 float camera_rotation_angle = 0;
 int x_pos=-10,z_pos=8;
 float x_theta=70,y_theta=0;
 float z_closness=20;
 float y_height=0;
 int cam_mode=0 ;// 0-Default 1-Chase 
+int board_width=10, board_height=10; // tiles, set with --board WIDTHxHEIGHT
+bool merge_tops=true; // merge the top faces of neighbouring tiles, off with --no-merge
+float lod_near=96, lod_far=256; // camera distance where chunks switch to LOD 1 and LOD 2, set with --lod NEAR,FAR
+bool occlusion_culling=true; // skip chunks hidden behind nearer ones, off with --no-occlusion
+bool gpu_culling=false; // cull every tile in a compute shader instead of chunks on the CPU (G key)
+bool goal_label=false; // label the crown tile with cached 3D text, --goal-label
+bool verify_assets=false; // hash bundled assets as they are loaded, --verify-assets
+const char* startup_report=NULL; // write the startup report as JSON to this file and quit, --startup-report FILE
+
+/* Where launch time goes - every startup phase is timed, with what it read, decoded and created */
+struct StartupPhase {
+	string name;
+	int depth;        // phases inside another one are indented in the report
+	double ms;
+	size_t bytesRead; // asset bytes, from the bundle or loose files
+	int texturesDecoded;
+	int glObjects;    // buffers, vertex arrays, textures, shaders, programs and queries
+	bool background;  // runs next to the other phases instead of inside them
+	chrono::steady_clock::time_point start;
+};
+
+struct StartupProfile {
+	chrono::steady_clock::time_point start; // process start, more or less
+	vector<StartupPhase> phases;
+	int depth;
+	atomic<size_t> bytesRead;      // counted by loadAsset, also on the material workers
+	atomic<int> texturesDecoded;
+	int glObjects;
+	int firstFrame;                // phase of the first frame until it is shown, -1 after
+	bool reported;
+} Startup;
+
+/* Start timing a phase - returns what endPhase needs */
+int beginPhase (const char* name, bool background=false)
+{
+	StartupPhase phase;
+	phase.name = name;
+	phase.background = background;
+	phase.depth = background ? Startup.depth : Startup.depth++;
+	phase.ms = 0;
+	phase.bytesRead = Startup.bytesRead;
+	phase.texturesDecoded = Startup.texturesDecoded;
+	phase.glObjects = Startup.glObjects;
+	phase.start = chrono::steady_clock::now();
+	Startup.phases.push_back(phase);
+	return Startup.phases.size() - 1;
+}
+
+void endPhase (int index)
+{
+	StartupPhase& phase = Startup.phases[index];
+	phase.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - phase.start).count();
+	phase.bytesRead = Startup.bytesRead - phase.bytesRead;
+	phase.texturesDecoded = Startup.texturesDecoded - phase.texturesDecoded;
+	phase.glObjects = Startup.glObjects - phase.glObjects;
+	if(!phase.background)
+		Startup.depth--;
+}
+
+/* Times the rest of the block as one startup phase */
+struct ScopedPhase {
+	int index;
+	ScopedPhase (const char* name) { index = beginPhase(name); }
+	~ScopedPhase () { endPhase(index); }
+};
+
+
+/* One attribute of an interleaved vertex */
+struct VertexAttrib {
+	GLuint Index;         // attribute location in the shaders
+	GLint Size;           // number of components
+	GLenum Type;          // GL_FLOAT, GL_HALF_FLOAT, GL_SHORT, GL_UNSIGNED_SHORT or GL_UNSIGNED_BYTE
+	GLboolean Normalized; // integers map to [0,1] ([-1,1] signed) instead of their value
+	int Offset;           // bytes from the start of the vertex
+};
 
+/* Layout of an interleaved vertex - captured once in the VAO when it is created. Meshes are built
+   from floats and packed into these types on upload, the shaders still read floats */
+struct VertexFormat {
+	int Stride;           // bytes per vertex
+	int NumAttribs;
+	VertexAttrib Attribs[4];
+};
+
+// position (attribute 0) + color (attribute 1) - object space halves, 8 bit colors : 12 bytes instead of 24
+const VertexFormat colorVertexFormat = { 12, 2, {
+	{ 0, 3, GL_HALF_FLOAT, GL_FALSE, 0 },
+	{ 1, 3, GL_UNSIGNED_BYTE, GL_TRUE, 8 } } };
+// position (attribute 0) + texture coordinate (attribute 2) - all halves : 12 bytes instead of 20
+const VertexFormat textureVertexFormat = { 12, 2, {
+	{ 0, 3, GL_HALF_FLOAT, GL_FALSE, 0 },
+	{ 2, 2, GL_HALF_FLOAT, GL_FALSE, 8 } } };
+// position (attribute 0) + material layer (attribute 5) + texture coordinate (attribute 2) - Scene.vert without OBJECT
+// Board corners are whole world units, merged caps repeat the texture a whole number of times : 12 bytes instead of 24
+const VertexFormat boardVertexFormat = { 12, 3, {
+	{ 0, 3, GL_SHORT, GL_FALSE, 0 },
+	{ 2, 2, GL_HALF_FLOAT, GL_FALSE, 8 },
+	{ 5, 1, GL_UNSIGNED_BYTE, GL_FALSE, 6 } } };
+// position (attribute 0) + normal (attribute 1) - fontrender.vert, as captured from FTGL : 20 bytes instead of 24
+const VertexFormat fontVertexFormat = { 20, 2, {
+	{ 0, 3, GL_FLOAT, GL_FALSE, 0 },
+	{ 1, 3, GL_SHORT, GL_TRUE, 12 } } };
+// position in pixels (attribute 0) + color (attribute 1) + texture coordinate (attribute 2) - HudText.vert, HudVertex
+const VertexFormat hudVertexFormat = { 12, 3, {
+	{ 0, 2, GL_SHORT, GL_FALSE, 0 },
+	{ 1, 3, GL_UNSIGNED_BYTE, GL_TRUE, 4 },
+	{ 2, 2, GL_UNSIGNED_SHORT, GL_TRUE, 8 } } };
 
 struct VAO {
 	GLuint VertexArrayID;
-	GLuint VertexBuffer;
-	GLuint ColorBuffer;
-	GLuint TextureBuffer;
+	GLuint VertexBuffer; // VBO - interleaved vertices
+	GLuint IndexBuffer;  // VBO - 16 bit indices
 	GLuint TextureID;
+	int TextureLayer; // layer of TextureID when it is a texture array
 
 	GLenum PrimitiveMode; // GL_POINTS, GL_LINE_STRIP, GL_LINE_LOOP, GL_LINES, GL_LINE_STRIP_ADJACENCY, GL_LINES_ADJACENCY, GL_TRIANGLE_STRIP, GL_TRIANGLE_FAN, GL_TRIANGLES, GL_TRIANGLE_STRIP_ADJACENCY and GL_TRIANGLES_ADJACENCY
 	GLenum FillMode; // GL_FILL, GL_LINE
-	int NumVertices;
+	int NumVertices; // unique vertices in VertexBuffer
+	int NumIndices;
+
+	const struct VertexFormat* Format; // layout of VertexBuffer
+	GLuint InstanceBuffer; // VBO - per instance data (instanced objects only)
+	int NumInstances;
+	bool Animated;         // some instance jumps - only then the animated shader variant is used
+	GLuint IndirectBuffer; // draw parameters written on the GPU (indirect objects only)
+
+	glm::vec3 BoundsMin, BoundsMax; // model space box around every vertex - used for culling
 };
 
 typedef struct VAO VAO;
 
-struct Cube {
+/* One tile of the board */
+struct Tile {
        int alive;
        int mobile;
-       float jump;
-       VAO *vao;
-} cube[130];
+       float jump; // starting height of a jumping tile
+};
+
+/* Jumping tiles rise JUMP_SPEED units a second up to JUMP_HEIGHT, then drop back - passed to Scene.vert as a define */
+#define JUMP_SPEED 0.6f
+#define JUMP_HEIGHT 3.0f
+
+/* Per instance data of a board tile - matches locations 3,4,5 of Scene.vert */
+struct TileInstance {
+	GLfloat offset[3]; // position of the tile on the board
+	GLfloat jump[2];   // starting height and speed of a jumping tile - the vertex shader animates it
+	GLfloat layer;     // layer of the material array to use
+};
+
+/* Size of a board tile - a jumping tile can rise JUMP_HEIGHT above it */
+#define TILE_WIDTH 2.0f
+#define TILE_HEIGHT 8.0f
+
+/* The board is split into chunks of CHUNK_SIZE x CHUNK_SIZE tiles - each has its own instance buffer */
+#define CHUNK_SIZE 32
+
+/* Chunks further from the camera use simpler meshes:
+   LOD 0 - exposed faces of every tile
+   LOD 1 - merged tops of the tiles and skirts along the board edge
+   LOD 2 - one slab over the whole chunk */
+#define NUM_LODS 3
+
+struct Chunk {
+	int row, column;    // first tile of the chunk
+	glm::vec3 min, max; // world space box around every tile of the chunk, jumps included
+	struct VAO* lods[NUM_LODS]; // still tiles at every level of detail, NULL when there is nothing to draw
+	struct VAO* jumpers; // shares the tile mesh, instances are the jumping tiles of the chunk - not drawn at LOD 2
+	int numTiles;       // alive tiles
+	bool solid;         // no holes - every column of the chunk is filled between JUMP_HEIGHT and TILE_HEIGHT
+	bool dirty;         // a tile changed since the chunk was built
+};
+
+/* Still tiles are meshed per chunk without the faces they hide, jumping tiles share one cube mesh */
+struct Board {
+	struct VAO* mesh; // a single tile, drawn once per jumper
+	bool mergeTops;   // greedy merge of the top faces of neighbouring tiles - off with --no-merge
+	int layers[3]; // material layers of land, jumper and crown tiles
+	int width, height;
+	vector<Tile> tiles; // row by row
+	vector<Chunk> chunks;
+	int chunkColumns;
+} board;
+
+/* Corner of the tile in row, column - the board is centered on the origin */
+glm::vec3 tilePosition (int row, int column)
+{
+	return glm::vec3((column - board.width/2) * TILE_WIDTH, 0, (row - board.height/2) * TILE_WIDTH);
+}
+
+/* The whole board drawn from one buffer of every alive tile - a compute shader culls the tiles
+   and writes the instance count of the draw, so the CPU never looks at a tile */
+struct GPUCull {
+	bool available;        // compute shaders, storage buffers and indirect draws are supported
+	struct ShaderProgram* program; // BoardCull.comp
+	GLuint TileBuffer;     // SSBO - TileInstance of every alive tile
+	GLuint IndirectBuffer; // DrawElementsIndirectCommand written by the compute shader
+	struct VAO* vao;       // the tile mesh, instanced from the visible tiles
+	int numTiles;
+	GLint maxGroups[2];    // GL_MAX_COMPUTE_WORK_GROUP_COUNT in x and y - tiles are spread over both
+	bool dirty;            // a tile changed since TileBuffer was filled
+} gpuCull;
+
+/* Objects around the board */
+struct SceneObject {
+	struct VAO* vao;
+	glm::vec3 position;
+} player_cube;
+
+/* Scenery that never moves - every box is baked in world space into one mesh when the level loads */
+struct StaticBatch {
+	vector<glm::vec3> boxMin, boxMax; // world space boxes of the batch - they are occluders too
+	vector<int> layers;               // material layer of every box
+	struct VAO* vao;                  // drawn in world space, no model matrix
+} scenery;
 
 struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID; // For use with normal shader
-	GLuint TexMatrixID; // For use with texture shader
+	glm::vec3 eye; // camera position of this frame
 } Matrices;
 
+/* std140 layout of the "Camera" uniform block - written once per frame */
+#define CAMERA_BINDING 0
+struct CameraBlock {
+	glm::mat4 projection;
+	glm::mat4 view;
+	glm::mat4 VP; // projection * view
+	GLfloat time; // seconds since start - drives the jumping tiles
+	GLfloat pad[3]; // std140 rounds the block up to a vec4
+};
+
+/* std140 layout of the "Object" uniform block - written once per draw */
+#define OBJECT_BINDING 1
+struct ObjectBlock {
+	glm::mat4 model;
+	GLfloat color[3]; // text color of the font program
+	GLint texLayer;   // layer of the material array
+};
+
+/* Per frame data goes into one buffer split into RING_FRAMES parts - the CPU writes one part
+   while the GPU may still be reading the other ones, a fence tells when a part is free again */
+#define RING_FRAMES 3
+#define RING_FRAME_SIZE (256*1024) // bytes of camera and object blocks a frame can use
+
+struct UploadRing {
+	GLuint Buffer;     // UBO - bound by range to CAMERA_BINDING and OBJECT_BINDING
+	char* mapped;      // persistent mapping of every part, or a copy of one part when orphaning
+	bool persistent;   // ARB_buffer_storage - otherwise the buffer is orphaned and refilled every frame
+	GLint alignment;   // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	int frame;         // part written this frame
+	size_t used;       // bytes of the part written so far
+	bool flushed;      // fallback only - GL has everything written so far
+	GLsync fences[RING_FRAMES]; // signalled when the GPU is done with a part
+} Ring;
+
+/* Every image of the scene is one layer of a single texture array */
+#define MATERIAL_SIZE 256 // width and height of every layer
+#define MATERIAL_LEVELS 9  // mip chain from MATERIAL_SIZE down to 1x1
+
+/* The images are cooked once into BC1 (DXT1) with all their mip levels, stored in this file and
+   uploaded as they are - the signature of the source files tells when it has to be cooked again */
+#define MATERIAL_CACHE "materials.cache"
+#define MATERIAL_CACHE_MAGIC "MATC0001"
+
+struct MaterialArray {
+	GLuint TextureID; // GL_TEXTURE_2D_ARRAY - stays bound to texture unit 0
+	int NumLayers;
+	bool Compressed;  // BC1 from the cache, plain RGB when S3TC is missing
+} Materials;
+
+/* Images that are not in the cache are decoded on worker threads while the game already runs */
+struct MaterialLoader {
+	vector<string> filenames;  // layer i is filenames[i]
+	vector< vector<unsigned char> > levels; // every layer of level 0, then of level 1... - as in the cache
+	string signature;          // of the images, for the cache
+	vector<thread> workers;
+	atomic<int> next;          // next layer to cook
+	mutex lock;                // guards ready
+	vector<int> ready;         // cooked layers the main thread has not uploaded yet
+	int uploaded;
+	GLuint PixelBuffer;        // GL_PIXEL_UNPACK_BUFFER the layers are streamed through
+	double start;
+	int phase;                 // startup phase of the background work
+} Loader;
+
+/* Counters of the current frame, printed once a second when stats are on (I key) */
+struct FrameStats {
+	int drawCalls;
+	int stateCalls;   // GL state changes actually issued
+	int stateElided;  // GL state changes skipped because nothing would change
+	int triangles;
+	int lodChunks[NUM_LODS]; // chunks drawn at each level of detail
+	int occluded;            // chunks in the frustum hidden by the occlusion buffer
+	double occluderTime;     // ms spent rasterizing occluders
+	double occlusionTestTime; // ms spent testing chunks against them
+	double hudTime;          // ms spent building and drawing the HUD text
+	int visible;      // tiles and objects inside the view frustum
+	int culled;       // tiles and objects skipped by frustum culling
+} Stats;
+bool show_stats = false;
+string stats_text; // averages of the last second, shown on the HUD when stats are on
+
+/* Shadow copy of the GL state - a call that would not change it is skipped */
+struct GLStateCache {
+	GLuint program;
+	GLuint vertexArray;
+	GLuint textureArray; // GL_TEXTURE_2D_ARRAY bound to unit 0
+	GLenum fillMode;
+	bool valid; // false when something outside the cache may have changed GL state
+} GLState;
+
 struct FTGLFont {
 	FTFont* font;
-	GLuint fontMatrixID;
-	GLuint fontColorID;
 } GL3Font;
 
-GLuint programID, fontProgramID, textureProgramID;
+/* Extruded strings are tessellated by FTGL once per (text, size, depth) and kept as meshes,
+   the least recently drawn ones are dropped when they take more than TEXT_CACHE_BYTES */
+#define TEXT_CACHE_BYTES (2*1024*1024)
+#define TEXT_TRIANGLES_PER_CHAR 256 // first guess for the capture buffer, retried when short
+
+struct TextMesh {
+	string text;  // to tell hash collisions apart
+	unsigned int size;
+	float depth;
+	struct VAO* vao;
+	size_t bytes; // vertex + index buffers
+	list<unsigned long long>::iterator recent;
+};
+
+struct TextCache {
+	map<unsigned long long, TextMesh> meshes; // hash of (text, size, depth) -> mesh
+	list<unsigned long long> recent;          // most recently drawn first
+	size_t bytes;
+	int hits, misses, evictions;
+} Texts;
+
+/* Every image file and every box size is turned into GL objects only once */
+struct ResourceCache {
+	map<string, int> layers; // image file name -> layer of the material array
+	map< tuple<float,float,float>, struct VAO* > meshes; // (l,b,h) -> textured box mesh
+	int textureHits, textureMisses;
+	int meshHits, meshMisses;
+	size_t vertexBytes, floatVertexBytes; // vertex buffers as uploaded, and as they would be in plain floats
+} Resources;
+
+/* 2D text over the scene - arial.ttf is rasterized once into a glyph atlas, then every string of
+   the frame becomes quads of one vertex buffer drawn with a single call */
+#define HUD_FONT_SIZE 18     // pixels
+#define HUD_ATLAS_SIZE 512
+#define HUD_TEXTURE_UNIT 1   // unit 0 keeps the material array
+#define HUD_MAX_GLYPHS 16384 // 4 vertices each, so indices fit in 16 bits
+
+struct HudGlyph {
+	GLfloat uv[4];  // left, top, right, bottom of the glyph in the atlas
+	int width, height;
+	int left, top;  // bitmap position from the pen - top is above the baseline
+	int advance;
+};
+
+struct HudVertex {
+	GLshort position[2]; // pixels from the top left of the window
+	GLubyte color[4];    // the last byte only pads
+	GLushort uv[2];      // fractions of the atlas, 65535 is 1
+};
+
+struct HudRenderer {
+	GLuint AtlasID;       // GL_TEXTURE_2D - glyph coverage in the red channel
+	HudGlyph glyphs[128]; // printable ASCII
+	int ascent;           // pixels from the top of a line to its baseline
+	int lineHeight;
+	struct VAO* vao;      // VertexBuffer is refilled every frame, IndexBuffer is built once
+	vector<HudVertex> vertices; // quads of this frame
+	struct ShaderProgram* program;
+	int screenWidth, screenHeight; // framebuffer size
+} Hud;
+
+/* A linked program and the locations of all its active uniforms */
+struct ShaderProgram {
+	GLuint ProgramID;
+	map<string, GLint> uniforms; // filled once at link time
+	bool HasObject; // reads the "Object" uniform block
+	bool Linked;
+	// Build still running in the driver - finishProgram checks it on first use
+	bool Pending;
+	GLuint Shaders[2]; // 0 when unused
+	string Paths[2];   // of the shaders, for the log
+	unsigned long long Key; // of the program binary cache
+};
+
+ShaderProgram *fontProgram;
+
+/* Scene objects are drawn by variants of one shader, each compiled with only the features it needs */
+#define SHADER_TEXTURED 1  // texture coords and the material array, else vertex colors
+#define SHADER_OBJECT 2    // model matrix and layer from the Object block, else world space with a layer per vertex
+#define SHADER_INSTANCED 4 // board tiles placed per instance
+#define SHADER_ANIMATED 8  // jumping instances
+#define NUM_SHADER_FEATURES 4
+const char* shaderFeatures[NUM_SHADER_FEATURES] = { "TEXTURED", "OBJECT", "INSTANCED", "ANIMATED" };
+map<int, ShaderProgram*> sceneVariants; // features -> program
+
+/* Every file the game loads can come from one packed bundle - it is mapped once at startup and the
+   loaders get pointers straight into it. ./Game --pack writes it from the loose files */
+#define BUNDLE_FILE "assets.pak"
+#define BUNDLE_MAGIC "GAMEPAK1"
+#define BUNDLE_ALIGNMENT 64 // every asset starts on a cache line
+
+struct BundleHeader {
+	char magic[8];
+	GLuint count;     // entries of the table of contents, right after the header
+	GLuint alignment;
+};
+
+struct BundleEntry {
+	char name[56];
+	unsigned long long offset, size;  // bytes from the start of the bundle
+	unsigned long long hash;          // FNV-1a of the contents
+	long long sourceSize, sourceTime; // of the loose file (time in ns) - --pack skips files that did not change
+};
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+struct AssetBundle {
+	const unsigned char* data; // mapped bundle, NULL when the loose files are used
+	size_t size;
+	map<string, const BundleEntry*> entries;
+} Bundle;
+
+/* Contents of one asset - a view into the bundle, or a copy of the loose file */
+struct Asset {
+	const unsigned char* data;
+	size_t size;
+	unsigned long long hash;
+	vector<unsigned char> copy; // only used without the bundle
+};
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+// What --pack puts in the bundle
+const char* bundleFiles[] = {
+	"land.jpeg", "jumper.jpeg", "last.jpeg", "player.jpeg", "water.jpeg",
+	"Scene.vert", "Scene.frag", "fontrender.vert", "fontrender.frag",
+	"HudText.vert", "HudText.frag", "BoardCull.comp", "arial.ttf" };
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
+/* FNV-1a - pass the previous hash to continue it over more data */
+unsigned long long fnv1a (const void* data, size_t size, unsigned long long hash=14695981039346656037ULL)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i=0; i<size; i++)
 	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
 	}
+	return hash;
+}
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+/* Size and modification time (ns) of a loose file, as kept in the bundle */
+bool fileStamp (const char* name, long long& size, long long& time)
+{
+	struct stat info;
+	if(stat(name, &info) != 0)
+		return false;
+	size = info.st_size;
+	time = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+	return true;
+}
+
+/* Map the bundle and index its table of contents - without one every asset is read from its own file */
+void openBundle (bool checkFiles=true)
+{
+	int fd = open(BUNDLE_FILE, O_RDONLY);
+	if(fd < 0)
+		return;
+	struct stat info;
+	void* data = MAP_FAILED;
+	if(fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(BundleHeader))
+		data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping stays
+	if(data == MAP_FAILED)
+		return;
+
+	const BundleHeader* header = (const BundleHeader*)data;
+	size_t tocEnd = sizeof(BundleHeader) + (size_t)header->count * sizeof(BundleEntry);
+	if(memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 || tocEnd > (size_t)info.st_size)
+	{
+		cout << "Error: '" << BUNDLE_FILE << "' is not a bundle" << endl;
+		munmap(data, info.st_size);
+		return;
+	}
+	Bundle.data = (const unsigned char*)data;
+	Bundle.size = info.st_size;
+	const BundleEntry* toc = (const BundleEntry*)(Bundle.data + sizeof(BundleHeader));
+	for (GLuint i=0; i<header->count; i++)
+	{
+		if(toc[i].offset > Bundle.size || toc[i].size > Bundle.size - toc[i].offset)
+			continue;
+		// A loose file edited after packing wins - decided here, before any thread loads assets
+		string name(toc[i].name, strnlen(toc[i].name, sizeof(toc[i].name)));
+		long long size, time;
+		if(checkFiles && fileStamp(name.c_str(), size, time) && (size != toc[i].sourceSize || time != toc[i].sourceTime))
+		{
+			cout << "Warning: '" << name << "' changed since it was packed, using the file - run --pack again" << endl;
+			continue;
+		}
+		Bundle.entries[name] = &toc[i];
 	}
+	cout << "Assets: " << Bundle.entries.size() << " files in '" << BUNDLE_FILE << "'" << endl;
+}
 
-	GLint Result = GL_FALSE;
-	int InfoLogLength;
+/* The bundle entry of an asset - read only, the material workers look assets up too */
+const BundleEntry* bundleEntry (const char* name)
+{
+	map<string, const BundleEntry*>::iterator it = Bundle.entries.find(name);
+	return it == Bundle.entries.end() ? NULL : it->second;
+}
 
-	// Compile Vertex Shader
-	cout << "Compiling shader : " <<  vertex_file_path << endl;
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-	glCompileShader(VertexShaderID);
-
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage( max(InfoLogLength, int(1)) );
-	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	cout << VertexShaderErrorMessage.data() << endl;
-
-	// Compile Fragment Shader
-	cout << "Compiling shader : " << fragment_file_path << endl;
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
-
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage( max(InfoLogLength, int(1)) );
-	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	cout << FragmentShaderErrorMessage.data() << endl;
-
-	// Link the program
-	cout << "Linking program" << endl;
+/* Contents of an asset - from the bundle when it has a current copy, else from the file itself.
+   Bundled contents are trusted, --pack and --verify-assets check them against their hash */
+bool loadAsset (const char* name, Asset& asset)
+{
+	if(const BundleEntry* entry = bundleEntry(name))
+	{
+		if(!verify_assets || fnv1a(Bundle.data + entry->offset, entry->size) == entry->hash)
+		{
+			asset.data = Bundle.data + entry->offset;
+			asset.size = entry->size;
+			asset.hash = entry->hash;
+			Startup.bytesRead += asset.size;
+			return true;
+		}
+		cout << "Error: '" << name << "' is damaged in '" << BUNDLE_FILE << "', using the file" << endl;
+	}
+
+	ifstream file(name, ios::in | ios::binary);
+	if(!file.is_open())
+	{
+		asset.data = NULL;
+		asset.size = 0;
+		return false;
+	}
+	asset.copy.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+	asset.data = asset.copy.empty() ? NULL : &asset.copy[0];
+	asset.size = asset.copy.size();
+	asset.hash = fnv1a(asset.data, asset.size);
+	Startup.bytesRead += asset.size;
+	return true;
+}
+
+/* Write the bundle again from the loose files - files with the size and time they were packed
+   with are copied over from the old bundle without being read */
+void packBundle ()
+{
+	openBundle(false); // the stamps are compared below, changed files are packed again
+	int count = sizeof(bundleFiles) / sizeof(bundleFiles[0]), changed = 0;
+	vector<BundleEntry> toc(count);
+	vector< vector<unsigned char> > contents(count);
+	for (int i=0; i<count; i++)
+	{
+		BundleEntry& entry = toc[i];
+		memset(&entry, 0, sizeof(entry));
+		strncpy(entry.name, bundleFiles[i], sizeof(entry.name)-1);
+		if(!fileStamp(bundleFiles[i], entry.sourceSize, entry.sourceTime))
+		{
+			cout << "Error: could not pack '" << bundleFiles[i] << "'" << endl;
+			exit(EXIT_FAILURE);
+		}
+
+		// unchanged files are copied over when their packed contents are still intact
+		map<string, const BundleEntry*>::iterator old = Bundle.entries.find(bundleFiles[i]);
+		if(old != Bundle.entries.end() && old->second->sourceSize == entry.sourceSize && old->second->sourceTime == entry.sourceTime
+		   && fnv1a(Bundle.data + old->second->offset, old->second->size) == old->second->hash)
+		{
+			const unsigned char* data = Bundle.data + old->second->offset;
+			contents[i].assign(data, data + old->second->size);
+			entry.hash = old->second->hash;
+			continue;
+		}
+		Asset asset;
+		Bundle.entries.erase(bundleFiles[i]); // read the file itself
+		loadAsset(bundleFiles[i], asset);
+		contents[i].swap(asset.copy);
+		entry.hash = asset.hash;
+		changed++;
+		cout << "Packing '" << bundleFiles[i] << "'" << endl;
+	}
+	if(changed == 0 && Bundle.entries.size() == (size_t)count)
+	{
+		cout << "'" << BUNDLE_FILE << "' is up to date" << endl;
+		return;
+	}
+
+	// Header, table of contents, then every asset aligned
+	BundleHeader header;
+	memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+	header.count = count;
+	header.alignment = BUNDLE_ALIGNMENT;
+	unsigned long long offset = sizeof(BundleHeader) + count * sizeof(BundleEntry);
+	for (int i=0; i<count; i++)
+	{
+		offset = (offset + BUNDLE_ALIGNMENT-1) / BUNDLE_ALIGNMENT * BUNDLE_ALIGNMENT;
+		toc[i].offset = offset;
+		toc[i].size = contents[i].size();
+		offset += toc[i].size;
+	}
+	string temporary = string(BUNDLE_FILE) + ".tmp";
+	ofstream file(temporary.c_str(), ios::out | ios::binary | ios::trunc);
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)&toc[0], count * sizeof(BundleEntry));
+	for (int i=0; i<count; i++)
+	{
+		static const char padding[BUNDLE_ALIGNMENT] = {0};
+		file.write(padding, toc[i].offset - (unsigned long long)file.tellp());
+		if(!contents[i].empty())
+			file.write((const char*)&contents[i][0], contents[i].size());
+	}
+	file.close();
+	if(!file || rename(temporary.c_str(), BUNDLE_FILE) != 0)
+	{
+		cout << "Error: could not write '" << BUNDLE_FILE << "'" << endl;
+		exit(EXIT_FAILURE);
+	}
+	cout << "Packed " << count << " files into '" << BUNDLE_FILE << "', " << changed << " changed" << endl;
+}
+
+/* Linked programs are kept as driver binaries, one file per program named after the hash of its
+   sources and the driver - any change of either just misses and compiles from source again */
+#define PROGRAM_CACHE "shaders.cache"
+#define PROGRAM_CACHE_MAGIC "PRGB0001"
+
+struct ProgramCache {
+	bool available;  // GL 4.1 or ARB_get_program_binary, with at least one binary format
+	bool parallel;   // ARB_parallel_shader_compile - the driver compiles on its own threads
+	unsigned long long driver; // hash of vendor, renderer and version
+	int hits, misses;
+	double time;     // ms spent creating programs, from binaries or from source
+} Programs;
+
+/* Entry point of a GL version newer than 3.3 - the loader is generated for 3.3 and only loads it
+   when its extension is listed, which a context of that version does not have to do */
+template <typename Proc>
+bool loadCoreProc (Proc& proc, const char* name, int major, int minor)
+{
+	if(proc == NULL && (GLVersion.major > major || (GLVersion.major == major && GLVersion.minor >= minor)))
+		proc = (Proc)glfwGetProcAddress(name);
+	return proc != NULL;
+}
+
+/* Whether binaries can be used at all - looked up with the first program */
+void initProgramCache ()
+{
+	static bool done = false;
+	if(done)
+		return;
+	done = true;
+	GLint formats = 0;
+	if(loadCoreProc(glad_glGetProgramBinary, "glGetProgramBinary", 4, 1)
+	   && loadCoreProc(glad_glProgramBinary, "glProgramBinary", 4, 1)
+	   && loadCoreProc(glad_glProgramParameteri, "glProgramParameteri", 4, 1))
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	Programs.available = formats > 0;
+	// Let the driver use as many compiler threads as it likes
+	Programs.parallel = GLAD_GL_ARB_parallel_shader_compile;
+	if(Programs.parallel)
+		glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+	const GLenum strings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	Programs.driver = fnv1a(PROGRAM_CACHE_MAGIC, 8);
+	for (int i=0; i<3; i++)
+	{
+		const char* value = (const char*)glGetString(strings[i]);
+		if(value != NULL)
+			Programs.driver = fnv1a(value, strlen(value)+1, Programs.driver);
+	}
+	if(Programs.available)
+		mkdir(PROGRAM_CACHE, 0755);
+}
+
+/* Hash of the sources of a program, its defines, its captured outputs and the driver */
+unsigned long long programKey (const Asset* sources, int count, const char** feedback_varyings, int num_varyings, const string& defines)
+{
+	initProgramCache();
+	unsigned long long key = fnv1a(defines.data(), defines.size(), Programs.driver);
+	for (int i=0; i<count; i++)
+		key = fnv1a(sources[i].data, sources[i].size, fnv1a(&sources[i].size, sizeof(sources[i].size), key));
+	for (int i=0; i<num_varyings; i++)
+		key = fnv1a(feedback_varyings[i], strlen(feedback_varyings[i])+1, key);
+	return key;
+}
+
+string programCachePath (unsigned long long key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", key);
+	return string(PROGRAM_CACHE) + "/" + name;
+}
+
+/* A linked program from its cached binary, 0 when there is none or the driver refuses it */
+GLuint loadProgramBinary (unsigned long long key)
+{
+	if(!Programs.available)
+		return 0;
+	Asset file;
+	if(!loadAsset(programCachePath(key).c_str(), file) || file.size <= 8 + sizeof(GLenum)
+	   || memcmp(file.data, PROGRAM_CACHE_MAGIC, 8) != 0)
+		return 0;
+	GLenum format;
+	memcpy(&format, file.data + 8, sizeof(format));
 	GLuint ProgramID = glCreateProgram();
-	glAttachShader(ProgramID, VertexShaderID);
-	glAttachShader(ProgramID, FragmentShaderID);
-	glLinkProgram(ProgramID);
+	Startup.glObjects++;
+	glProgramBinary(ProgramID, format, file.data + 8 + sizeof(format), file.size - 8 - sizeof(format));
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if(Result != GL_TRUE)
+	{
+		glDeleteProgram(ProgramID);
+		return 0;
+	}
+	return ProgramID;
+}
 
-	// Check the program
+/* Keep the binary of a program that was just linked from source */
+void saveProgramBinary (unsigned long long key, GLuint ProgramID)
+{
+	if(!Programs.available)
+		return; // GL_PROGRAM_BINARY_LENGTH is not even a valid query
+	GLint Result = GL_FALSE, length = 0;
 	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if(Result != GL_TRUE)
+		return;
+	glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if(length <= 0)
+		return;
+	vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(ProgramID, length, &length, &format, &binary[0]);
+	ofstream file(programCachePath(key).c_str(), ios::out | ios::binary | ios::trunc);
+	file.write(PROGRAM_CACHE_MAGIC, 8);
+	file.write((const char*)&format, sizeof(format));
+	file.write(&binary[0], length);
+}
+
+/* Start compiling one shader - its status is only looked at by finishProgram */
+GLuint submitShader (GLenum type, const Asset& code, const string& defines)
+{
+	GLuint ShaderID = glCreateShader(type);
+	Startup.glObjects++;
+	// The shader code - straight from the bundle, GL takes its length so nothing is copied. The
+	// defines of a variant go in as a second string right after the #version line, or instead of
+	// it when they start with their own
+	const char* source = (const char*)code.data;
+	const char* newline = source ? (const char*)memchr(source, '\n', code.size) : NULL;
+	GLint version = newline ? newline - source + 1 : 0;
+	bool replaced = defines.compare(0, 8, "#version") == 0;
+	char const * SourcePointers[3] = { source, defines.c_str(), source + version };
+	GLint SourceLengths[3] = { replaced ? 0 : version, (GLint)defines.size(), (GLint)(code.size - version) };
+	glShaderSource(ShaderID, 3, SourcePointers, SourceLengths);
+	glCompileShader(ShaderID);
+	return ShaderID;
+}
+
+/* Look up every uniform of a linked program once, so draws never call glGetUniformLocation */
+void reflectProgram (ShaderProgram* program)
+{
+	GLint numUniforms = 0, maxLength = 0;
+	glGetProgramiv(program->ProgramID, GL_ACTIVE_UNIFORMS, &numUniforms);
+	glGetProgramiv(program->ProgramID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	vector<char> name(max(maxLength, 1));
+	for (GLint i=0; i<numUniforms; i++)
+	{
+		GLint size;
+		GLenum type;
+		glGetActiveUniform(program->ProgramID, i, name.size(), NULL, &size, &type, &name[0]);
+		GLint location = glGetUniformLocation(program->ProgramID, &name[0]);
+		if(location < 0)
+			continue; // member of a uniform block
+		string uniform(&name[0]);
+		program->uniforms[uniform] = location;
+		// Arrays are reported as "name[0]" - make "name" work too
+		if(uniform.size() > 3 && uniform.compare(uniform.size()-3, 3, "[0]") == 0)
+			program->uniforms[uniform.substr(0, uniform.size()-3)] = location;
+	}
+	// Every program reads the camera and its object from ranges of the upload ring
+	GLuint cameraIndex = glGetUniformBlockIndex(program->ProgramID, "Camera");
+	if(cameraIndex != GL_INVALID_INDEX)
+		glUniformBlockBinding(program->ProgramID, cameraIndex, CAMERA_BINDING);
+	GLuint objectIndex = glGetUniformBlockIndex(program->ProgramID, "Object");
+	program->HasObject = (objectIndex != GL_INVALID_INDEX);
+	if(program->HasObject)
+		glUniformBlockBinding(program->ProgramID, objectIndex, OBJECT_BINDING);
+}
+
+/* Start building a program from shader files - from its cached binary when the driver still has it,
+   else every compile and the link are only submitted so the driver works on them in the background */
+ShaderProgram* submitProgram (const char** paths, const GLenum* types, int count, const char** feedback_varyings, int num_varyings, const string& defines)
+{
+	double start = glfwGetTime();
+	ShaderProgram* program = new ShaderProgram();
+	Asset Sources[2];
+	for (int i=0; i<count; i++)
+		loadAsset(paths[i], Sources[i]);
+
+	// Nothing to compile when the driver still has this program
+	program->Key = programKey(Sources, count, feedback_varyings, num_varyings, defines);
+	program->ProgramID = loadProgramBinary(program->Key);
+	if(program->ProgramID != 0)
+	{
+		Programs.hits++;
+		program->Linked = true;
+		reflectProgram(program);
+		Programs.time += (glfwGetTime() - start) * 1000;
+		return program;
+	}
+	Programs.misses++;
+
+	program->ProgramID = glCreateProgram();
+	Startup.glObjects++;
+	for (int i=0; i<count; i++)
+	{
+		program->Shaders[i] = submitShader(types[i], Sources[i], defines);
+		program->Paths[i] = paths[i];
+		glAttachShader(program->ProgramID, program->Shaders[i]);
+	}
+	// Outputs the program can write back into a buffer, they have to be known before linking
+	if(num_varyings > 0)
+		glTransformFeedbackVaryings(program->ProgramID, num_varyings, feedback_varyings, GL_INTERLEAVED_ATTRIBS);
+	if(Programs.available)
+		glProgramParameteri(program->ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(program->ProgramID);
+	program->Pending = true;
+	Programs.time += (glfwGetTime() - start) * 1000;
+	return program;
+}
+
+/* Wait for a submitted program the first time it is needed - print the logs, keep its binary and
+   look up its uniforms. Programs from the binary cache are ready at once */
+ShaderProgram* finishProgram (ShaderProgram* program)
+{
+	if(!program->Pending)
+		return program;
+	double start = glfwGetTime();
+	program->Pending = false;
+
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+	for (int i=0; i<2 && program->Shaders[i] != 0; i++)
+	{
+		// Check Shader
+		cout << "Compiling shader : " << program->Paths[i] << endl;
+		glGetShaderiv(program->Shaders[i], GL_COMPILE_STATUS, &Result);
+		glGetShaderiv(program->Shaders[i], GL_INFO_LOG_LENGTH, &InfoLogLength);
+		std::vector<char> ShaderErrorMessage( max(InfoLogLength, int(1)) );
+		glGetShaderInfoLog(program->Shaders[i], InfoLogLength, NULL, &ShaderErrorMessage[0]);
+		cout << ShaderErrorMessage.data() << endl;
+	}
+
+	// Check the program
+	cout << "Linking program" << endl;
+	glGetProgramiv(program->ProgramID, GL_LINK_STATUS, &Result);
+	glGetProgramiv(program->ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
 	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+	glGetProgramInfoLog(program->ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
 	cout << ProgramErrorMessage.data() << endl;
+	program->Linked = (Result == GL_TRUE);
 
-	glDeleteShader(VertexShaderID);
-	glDeleteShader(FragmentShaderID);
+	for (int i=0; i<2 && program->Shaders[i] != 0; i++)
+		glDeleteShader(program->Shaders[i]);
 
-	return ProgramID;
+	saveProgramBinary(program->Key, program->ProgramID);
+	reflectProgram(program);
+	Programs.time += (glfwGetTime() - start) * 1000;
+	return program;
+}
+
+/* Location of a uniform of the program, -1 if it is not an active uniform */
+GLint uniformLocation (ShaderProgram* program, const char* name)
+{
+	finishProgram(program);
+	map<string, GLint>::iterator it = program->uniforms.find(name);
+	return (it != program->uniforms.end()) ? it->second : -1;
+}
+
+ShaderProgram* createShaderProgram (const char * vertex_file_path, const char * fragment_file_path, const char** feedback_varyings=NULL, int num_varyings=0)
+{
+	const char* paths[2] = { vertex_file_path, fragment_file_path };
+	const GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	return submitProgram(paths, types, 2, feedback_varyings, num_varyings, "");
+}
+
+ShaderProgram* createComputeProgram (const char * compute_file_path)
+{
+	// Compute shaders are written for 3.3 with the extensions, a 4.3 context builds them as 4.30
+	const GLenum type = GL_COMPUTE_SHADER;
+	bool core = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 3);
+	return submitProgram(&compute_file_path, &type, 1, NULL, 0, core ? "#version 430 core\n" : "");
+}
+
+/* The variant of Scene.vert/.frag with exactly these SHADER_* features - built on first request */
+ShaderProgram* sceneProgram (int features)
+{
+	map<int, ShaderProgram*>::iterator it = sceneVariants.find(features);
+	if(it != sceneVariants.end())
+		return it->second;
+
+	ostringstream defines;
+	for (int i=0; i<NUM_SHADER_FEATURES; i++)
+		if(features & (1 << i))
+			defines << "#define " << shaderFeatures[i] << "\n";
+	defines << fixed << "#define JUMP_HEIGHT " << JUMP_HEIGHT << "\n";
+	const char* paths[2] = { "Scene.vert", "Scene.frag" };
+	const GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	ShaderProgram* program = submitProgram(paths, types, 2, NULL, 0, defines.str());
+	sceneVariants[features] = program;
+	return program;
 }
 
 static void error_callback(int error, const char* description)
@@ -142,232 +960,1804 @@ static void error_callback(int error, const char* description)
 	cout << "Error: " << description << endl;
  }
 
+/* Wait for the material workers - threads still running when the game exits would abort it */
+void joinMaterialWorkers ()
+{
+	for (size_t i=0; i<Loader.workers.size(); i++)
+		Loader.workers[i].join();
+	Loader.workers.clear();
+}
+
 void quit(GLFWwindow *window)
 {
+	joinMaterialWorkers();
 	glfwDestroyWindow(window);
 	glfwTerminate();
 	exit(EXIT_SUCCESS);
 }
 
-glm::vec3 getRGBfromHue (int hue)
+/* Collects vertices and welds identical ones into an indexed mesh */
+struct MeshBuilder {
+	const VertexFormat* format;
+	int components; // floats per vertex
+	vector<GLfloat> vertices; // interleaved, in the order of format->Attribs
+	vector<GLushort> indices;
+	map< vector<GLfloat>, GLushort > lookup;
+};
+
+/* Floats per vertex of the format, before packing */
+int formatComponents (const VertexFormat* format)
+{
+	int components = 0;
+	for (int i=0; i<format->NumAttribs; i++)
+		components += format->Attribs[i].Size;
+	return components;
+}
+
+void initMesh (MeshBuilder& mesh, const VertexFormat* format)
+{
+	mesh.format = format;
+	mesh.components = formatComponents(format);
+	mesh.vertices.clear();
+	mesh.indices.clear();
+	mesh.lookup.clear();
+}
+
+/* Add one vertex (mesh.components floats) - a vertex seen before only adds an index */
+void addVertex (MeshBuilder& mesh, const GLfloat* vertex)
+{
+	vector<GLfloat> key(vertex, vertex + mesh.components);
+	map< vector<GLfloat>, GLushort >::iterator it = mesh.lookup.find(key);
+	if(it != mesh.lookup.end())
+	{
+		mesh.indices.push_back(it->second);
+		return;
+	}
+
+	int index = mesh.vertices.size() / mesh.components;
+	if(index > 0xFFFF)
+		cout << "Error: mesh has more than 65536 unique vertices" << endl;
+	mesh.vertices.insert(mesh.vertices.end(), key.begin(), key.end());
+	mesh.lookup[key] = index;
+	mesh.indices.push_back(index);
+}
+
+/* Add 4 vertices (mesh.components floats each) as two triangles - faces of a quad are never welded */
+void addQuad (MeshBuilder& mesh, const GLfloat* vertices)
+{
+	int first = mesh.vertices.size() / mesh.components;
+	if(first + 3 > 0xFFFF)
+		cout << "Error: mesh has more than 65536 unique vertices" << endl;
+	mesh.vertices.insert(mesh.vertices.end(), vertices, vertices + 4*mesh.components);
+	const int corners[6] = {0, 1, 2, 0, 2, 3};
+	for (int i=0; i<6; i++)
+		mesh.indices.push_back(first + corners[i]);
+}
+
+/* Interleave separate attribute arrays (a has sizeA floats per vertex, b has sizeB) into the mesh */
+void addVertices (MeshBuilder& mesh, int numVertices, const GLfloat* a, int sizeA, const GLfloat* b, int sizeB)
+{
+	GLfloat vertex[16];
+	for (int i=0; i<numVertices; i++)
+	{
+		for (int j=0; j<sizeA; j++)
+			vertex[j] = a[sizeA*i + j];
+		for (int j=0; j<sizeB; j++)
+			vertex[sizeA + j] = b[sizeB*i + j];
+		addVertex(mesh, vertex);
+	}
+}
+
+/* Forget the shadowed state - the next call of every kind goes to GL */
+void invalidateGLState ()
+{
+	GLState.valid = false;
+}
+
+/* Returns true when the shadowed value already matches, otherwise records the new one */
+template <typename T> bool stateMatches (T& shadow, T value)
+{
+	if(!GLState.valid)
+	{
+		GLState.program = GLState.vertexArray = GLState.textureArray = (GLuint)-1;
+		GLState.fillMode = GL_NONE;
+		GLState.valid = true;
+	}
+	if(shadow == value)
+	{
+		Stats.stateElided++;
+		return true;
+	}
+	shadow = value;
+	Stats.stateCalls++;
+	return false;
+}
+
+/* Programs are finished on their first use - see submitProgram */
+void useProgram (ShaderProgram* program)
+{
+	finishProgram(program);
+	if(!stateMatches(GLState.program, program->ProgramID))
+		glUseProgram(program->ProgramID);
+}
+
+void bindVertexArray (GLuint vertexArray)
+{
+	if(!stateMatches(GLState.vertexArray, vertexArray))
+		glBindVertexArray(vertexArray);
+}
+
+void bindTextureArray (GLuint texture)
+{
+	if(!stateMatches(GLState.textureArray, texture))
+	{
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	}
+}
+
+void polygonMode (GLenum fillMode)
+{
+	if(!stateMatches(GLState.fillMode, fillMode))
+		glPolygonMode(GL_FRONT_AND_BACK, fillMode);
+}
+
+/* Create the upload ring - mapped once for the whole run when the driver allows it */
+void initUploadRing ()
 {
-	float intp;
-	float fracp = modff(hue/60.0, &intp);
-	float x = 1.0 - abs((float)((int)intp%2)+fracp-1.0);
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &Ring.alignment);
+	glGenBuffers(1, &Ring.Buffer);
+	Startup.glObjects++;
+	glBindBuffer(GL_UNIFORM_BUFFER, Ring.Buffer);
 
-	if (hue < 60)
-		return glm::vec3(1,x,0);
-	else if (hue < 120)
-		return glm::vec3(x,1,0);
-	else if (hue < 180)
-		return glm::vec3(0,1,x);
-	else if (hue < 240)
-		return glm::vec3(0,x,1);
-	else if (hue < 300)
-		return glm::vec3(x,0,1);
+	Ring.persistent = GLAD_GL_ARB_buffer_storage;
+	if(Ring.persistent)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_UNIFORM_BUFFER, RING_FRAMES*RING_FRAME_SIZE, NULL, flags);
+		Ring.mapped = (char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, RING_FRAMES*RING_FRAME_SIZE, flags);
+	}
 	else
-		return glm::vec3(1,0,x);
+	{
+		glBufferData(GL_UNIFORM_BUFFER, RING_FRAME_SIZE, NULL, GL_STREAM_DRAW);
+		Ring.mapped = new char[RING_FRAME_SIZE];
+	}
+	cout << "Upload ring: " << (Ring.persistent ? "persistent mapping" : "orphaning") << endl;
+
+	Ring.frame = 0;
+	Ring.used = 0;
+	Ring.flushed = true;
+	for (int i=0; i<RING_FRAMES; i++)
+		Ring.fences[i] = NULL;
 }
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+/* Move to the next part of the ring - only waits when the GPU is RING_FRAMES frames behind */
+void beginRingFrame ()
+{
+	Ring.used = 0;
+	Ring.flushed = true;
+	if(!Ring.persistent)
+		return;
+
+	Ring.frame = (Ring.frame + 1) % RING_FRAMES;
+	GLsync fence = Ring.fences[Ring.frame];
+	if(fence != NULL)
+	{
+		while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(fence);
+		Ring.fences[Ring.frame] = NULL;
+	}
+}
+
+/* Room for size bytes in this frame's part, NULL when it is full - offset is from the start of Ring.Buffer */
+void* ringAlloc (size_t size, GLintptr& offset)
+{
+	size_t start = (Ring.used + Ring.alignment-1) / Ring.alignment * Ring.alignment;
+	if(start + size > RING_FRAME_SIZE)
+	{
+		cout << "Error: upload ring is full, raise RING_FRAME_SIZE" << endl;
+		return NULL;
+	}
+	Ring.used = start + size;
+	Ring.flushed = false;
+	offset = (Ring.persistent ? Ring.frame*RING_FRAME_SIZE : 0) + start;
+	return Ring.mapped + offset;
+}
+
+/* Make everything written so far visible to GL before drawing with it - a coherent mapping needs nothing,
+   the fallback gives the driver fresh storage so it never waits for draws still reading the old one */
+void flushRing ()
+{
+	if(Ring.persistent || Ring.flushed)
+		return;
+	glBindBuffer(GL_UNIFORM_BUFFER, Ring.Buffer);
+	glBufferData(GL_UNIFORM_BUFFER, RING_FRAME_SIZE, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, Ring.used, Ring.mapped);
+	Ring.flushed = true;
+}
+
+/* Mark the end of the draws reading this frame's part */
+void endRingFrame ()
+{
+	if(Ring.persistent)
+		Ring.fences[Ring.frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* Write the object block of a draw into the ring and bind it */
+bool bindObjectBlock (const glm::mat4& model, const GLfloat* color, int texLayer)
+{
+	GLintptr offset;
+	ObjectBlock* block = (ObjectBlock*)ringAlloc(sizeof(ObjectBlock), offset);
+	if(block == NULL)
+		return false;
+	block->model = model;
+	for (int i=0; i<3; i++)
+		block->color[i] = color[i];
+	block->texLayer = texLayer;
+	flushRing();
+	glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BINDING, Ring.Buffer, offset, sizeof(ObjectBlock));
+	return true;
+}
+
+/* Point the attributes of the bound VAO at the interleaved vertices of the bound VBO */
+void setVertexFormat (const VertexFormat* format)
+{
+	for (int i=0; i<format->NumAttribs; i++)
+	{
+		const VertexAttrib& attrib = format->Attribs[i];
+		glVertexAttribPointer(attrib.Index, attrib.Size, attrib.Type, attrib.Normalized, format->Stride, (void*)(size_t)attrib.Offset);
+		glEnableVertexAttribArray(attrib.Index);
+	}
+}
+
+/* Nearest half precision float - values past the half range become infinity */
+GLushort floatToHalf (float value)
+{
+	GLuint bits;
+	memcpy(&bits, &value, sizeof(bits));
+	GLuint sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+	GLuint mantissa = bits & 0x7FFFFF;
+	if(exponent >= 31)
+		return sign | 0x7C00;
+	if(exponent <= 0)
+	{
+		// Denormal half, or zero when it is too small even for that
+		if(exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		GLuint half = mantissa >> shift;
+		if((mantissa >> (shift-1)) & 1)
+			half++;
+		return sign | half;
+	}
+	// Rounding may carry into the exponent, which is still the right answer
+	GLuint half = sign | (exponent << 10) | (mantissa >> 13);
+	if(mantissa & 0x1000)
+		half++;
+	return half;
+}
+
+/* Convert one float to the type of an attribute - false when it had to be clamped */
+template <typename T>
+bool packInteger (float value, bool normalized, T* out)
+{
+	const float low = numeric_limits<T>::min(), high = numeric_limits<T>::max();
+	if(normalized)
+		value *= high;
+	float rounded = floorf(value + 0.5f);
+	*out = (T)std::min(std::max(rounded, low), high);
+	return rounded >= low && rounded <= high;
+}
+
+/* Write one vertex given as floats (in the order of format->Attribs) in the layout of the format */
+bool packVertex (const VertexFormat* format, const GLfloat* vertex, unsigned char* out)
+{
+	bool exact = true;
+	for (int i=0; i<format->NumAttribs; i++)
+	{
+		const VertexAttrib& attrib = format->Attribs[i];
+		unsigned char* dst = out + attrib.Offset;
+		for (int c=0; c<attrib.Size; c++, vertex++)
+			switch(attrib.Type)
+			{
+				case GL_HALF_FLOAT:
+					((GLushort*)dst)[c] = floatToHalf(*vertex);
+					break;
+				case GL_SHORT:
+					exact &= packInteger(*vertex, attrib.Normalized, &((GLshort*)dst)[c]);
+					break;
+				case GL_UNSIGNED_SHORT:
+					exact &= packInteger(*vertex, attrib.Normalized, &((GLushort*)dst)[c]);
+					break;
+				case GL_UNSIGNED_BYTE:
+					exact &= packInteger(*vertex, attrib.Normalized, &((GLubyte*)dst)[c]);
+					break;
+				default:
+					((GLfloat*)dst)[c] = *vertex;
+			}
+	}
+	return exact;
+}
+
+/* Generate VAO, VBOs and return VAO handle - one interleaved VBO and one index VBO */
+struct VAO* create3DIndexedObject (GLenum primitive_mode, const MeshBuilder& mesh, GLenum fill_mode=GL_FILL)
 {
 	struct VAO* vao = new struct VAO;
 	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
+	vao->NumVertices = mesh.vertices.size() / mesh.components;
+	vao->NumIndices = mesh.indices.size();
 	vao->FillMode = fill_mode;
+	vao->TextureID = 0;
+	vao->TextureLayer = 0;
+	vao->Format = mesh.format;
+	vao->InstanceBuffer = 0;
+	vao->NumInstances = 0;
+	vao->Animated = false;
+	vao->IndirectBuffer = 0;
+
+	// Bounds of the positions - attribute 0 always comes first
+	vao->BoundsMin = vao->BoundsMax = glm::vec3(mesh.vertices[0], mesh.vertices[1], mesh.vertices[2]);
+	for (size_t i=0; i<mesh.vertices.size(); i+=mesh.components)
+	{
+		glm::vec3 p(mesh.vertices[i], mesh.vertices[i+1], mesh.vertices[i+2]);
+		vao->BoundsMin = glm::min(vao->BoundsMin, p);
+		vao->BoundsMax = glm::max(vao->BoundsMax, p);
+	}
 
 	// Create Vertex Array Object
 	// Should be done after CreateWindow and before any other GL calls
 	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
 	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+	glGenBuffers (1, &(vao->IndexBuffer));  // VBO - indices
+	Startup.glObjects += 3;
 
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO
+	bindVertexArray (vao->VertexArrayID); // Bind the VAO
 	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-	glVertexAttribPointer(
-						  0,                  // attribute 0. Vertices
-						  3,                  // size (x,y,z)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
-
-	glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-	glVertexAttribPointer(
-						  1,                  // attribute 1. Color
-						  3,                  // size (r,g,b)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
+	// Pack the float vertices into the compact types of the format
+	vector<unsigned char> packed(vao->NumVertices * mesh.format->Stride, 0);
+	bool exact = true;
+	for (int i=0; i<vao->NumVertices; i++)
+		exact &= packVertex(mesh.format, &mesh.vertices[i*mesh.components], &packed[i*mesh.format->Stride]);
+	if(!exact)
+		cout << "Error: mesh has values out of the range of its vertex format" << endl;
+	Resources.vertexBytes += packed.size();
+	Resources.floatVertexBytes += mesh.vertices.size()*sizeof(GLfloat);
+	glBufferData (GL_ARRAY_BUFFER, packed.size(), &packed[0], GL_STATIC_DRAW); // Copy the vertices into VBO
+	glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer); // Bind the VBO indices - remembered by the VAO
+	glBufferData (GL_ELEMENT_ARRAY_BUFFER, mesh.indices.size()*sizeof(GLushort), &mesh.indices[0], GL_STATIC_DRAW);
+
+	// Attribute layout is stored in the VAO, draws only have to bind it
+	setVertexFormat(mesh.format);
 
 	return vao;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+/* Free the VAO and the VBOs it owns */
+void delete3DObject (struct VAO* vao)
+{
+	if(GLState.vertexArray == vao->VertexArrayID)
+		invalidateGLState();
+	Resources.vertexBytes -= vao->NumVertices * vao->Format->Stride;
+	Resources.floatVertexBytes -= vao->NumVertices * formatComponents(vao->Format) * sizeof(GLfloat);
+	glDeleteVertexArrays(1, &(vao->VertexArrayID));
+	glDeleteBuffers(1, &(vao->VertexBuffer));
+	glDeleteBuffers(1, &(vao->IndexBuffer));
+	delete vao;
+}
+
+/* Generate VAO, VBOs and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+	MeshBuilder mesh;
+	initMesh(mesh, &colorVertexFormat);
+	addVertices(mesh, numVertices, vertex_buffer_data, 3, color_buffer_data, 3);
+
+	return create3DIndexedObject(primitive_mode, mesh, fill_mode);
+}
+
+/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+{
+	GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+	for (int i=0; i<numVertices; i++) {
+		color_buffer_data [3*i] = red;
+		color_buffer_data [3*i + 1] = green;
+		color_buffer_data [3*i + 2] = blue;
+	}
+
+	struct VAO* vao = create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+	delete [] color_buffer_data;
+	return vao;
+}
+
+struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, GLuint textureID, GLenum fill_mode=GL_FILL)
+{
+	MeshBuilder mesh;
+	initMesh(mesh, &textureVertexFormat);
+	addVertices(mesh, numVertices, vertex_buffer_data, 3, texture_buffer_data, 2);
+
+	struct VAO* vao = create3DIndexedObject(primitive_mode, mesh, fill_mode);
+	vao->TextureID = textureID;
+	return vao;
+}
+
+/* Generate a VAO drawing the vertices of mesh once per instance with TileInstance data - the mesh VBOs are shared */
+struct VAO* create3DInstancedObject (const struct VAO* mesh)
+{
+	// Same vertices and indices, only the VAO and the instance buffer are new
+	struct VAO* vao = new struct VAO(*mesh);
+	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+	glGenBuffers (1, &(vao->InstanceBuffer));    // VBO - instances
+	Startup.glObjects += 2;
+	vao->NumInstances = 0;
+
+	bindVertexArray (vao->VertexArrayID);
+	glBindBuffer (GL_ARRAY_BUFFER, mesh->VertexBuffer);
+	glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, mesh->IndexBuffer);
+	setVertexFormat(mesh->Format);
+
+	// Instance attributes advance once per instance instead of once per vertex
+	glBindBuffer (GL_ARRAY_BUFFER, vao->InstanceBuffer); // Bind the VBO instances
+	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(TileInstance), (void*)offsetof(TileInstance, offset)); // attribute 3. Offset
+	glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, sizeof(TileInstance), (void*)offsetof(TileInstance, jump));   // attribute 4. Jump
+	glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, sizeof(TileInstance), (void*)offsetof(TileInstance, layer));  // attribute 5. Layer
+	for (int i=3; i<=5; i++) {
+		glEnableVertexAttribArray(i);
+		glVertexAttribDivisor(i, 1);
+	}
+
+	return vao;
+}
+
+/* Render the VBOs handled by VAO */
+void draw3DObject (struct VAO* vao)
+{
+	// Change the Fill Mode for this object
+	polygonMode (vao->FillMode);
+
+	// Bind the VAO to use - it holds the vertex layout and the index buffer
+	bindVertexArray (vao->VertexArrayID);
+
+	// Draw the geometry !
+	glDrawElements(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_SHORT, (void*)0);
+	Stats.drawCalls++;
+	Stats.triangles += vao->NumIndices / 3;
+}
+
+void draw3DTexturedObject (struct VAO* vao)
+{
+	// Change the Fill Mode for this object
+	polygonMode (vao->FillMode);
+
+	// Bind the VAO to use - it holds the vertex layout and the index buffer
+	bindVertexArray (vao->VertexArrayID);
+
+	// Bind the material array - the queue has already set this object's layer
+	bindTextureArray (vao->TextureID);
+
+	// Draw the geometry !
+	glDrawElements(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_SHORT, (void*)0);
+	Stats.drawCalls++;
+	Stats.triangles += vao->NumIndices / 3;
+}
+
+/* Render the VAO with the draw parameters in its indirect buffer - they never come back to the CPU */
+void draw3DIndirectObject (struct VAO* vao)
+{
+	// Change the Fill Mode for this object
+	polygonMode (vao->FillMode);
+
+	// Bind the VAO to use - all attributes were set up at creation
+	bindVertexArray (vao->VertexArrayID);
+	bindTextureArray (vao->TextureID);
+
+	// Draw with the instance count the GPU wrote
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, vao->IndirectBuffer);
+	glDrawElementsIndirect(vao->PrimitiveMode, GL_UNSIGNED_SHORT, (void*)0);
+	Stats.drawCalls++;
+}
+
+/* Replace the instance data of the VAO - instances only change when the board does */
+void setInstances (struct VAO* vao, const TileInstance* instances, int numInstances)
+{
+	vao->NumInstances = numInstances;
+	vao->Animated = false;
+	for (int i=0; i<numInstances; i++)
+		vao->Animated |= (instances[i].jump[1] != 0);
+	glBindBuffer(GL_ARRAY_BUFFER, vao->InstanceBuffer);
+	glBufferData(GL_ARRAY_BUFFER, numInstances*sizeof(TileInstance), instances, GL_STATIC_DRAW);
+}
+
+/* Render every instance of the VAO with a single draw call */
+void draw3DInstancedObject (struct VAO* vao)
+{
+	// Change the Fill Mode for this object
+	polygonMode (vao->FillMode);
+
+	// Bind the VAO to use - all attributes were set up at creation
+	bindVertexArray (vao->VertexArrayID);
+	bindTextureArray (vao->TextureID);
+
+	// Draw the geometry once per instance
+	glDrawElementsInstanced(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_SHORT, (void*)0, vao->NumInstances);
+	Stats.drawCalls++;
+	Stats.triangles += vao->NumIndices / 3 * vao->NumInstances;
+}
+
+/* One object waiting to be drawn this frame */
+struct DrawItem {
+	ShaderProgram* program;
+	glm::mat4 model;  // unused by instanced objects
+	struct VAO* vao;
+	GLintptr objectOffset; // ObjectBlock of the draw in the upload ring, -1 when there is none
+};
+
+/* Planes of the view frustum as (normal, distance) - a point p is inside a plane when dot(normal, p) + distance >= 0 */
+struct Frustum {
+	glm::vec4 planes[6]; // left, right, bottom, top, near, far
+} viewFrustum;
+
+/* Extract the frustum planes from the rows of a view-projection matrix */
+void extractFrustum (Frustum& frustum, const glm::mat4& vp)
+{
+	glm::vec4 row[4];
+	for (int i=0; i<4; i++)
+		row[i] = glm::vec4(vp[0][i], vp[1][i], vp[2][i], vp[3][i]);
+
+	for (int i=0; i<3; i++)
+	{
+		frustum.planes[2*i] = row[3] + row[i];
+		frustum.planes[2*i+1] = row[3] - row[i];
+	}
+}
+
+/* False only when the box is completely outside one of the planes */
+bool boxInFrustum (const Frustum& frustum, const glm::vec3& min, const glm::vec3& max)
+{
+	for (int i=0; i<6; i++)
+	{
+		const glm::vec4& plane = frustum.planes[i];
+		// corner of the box furthest along the plane normal
+		glm::vec3 p(plane.x >= 0 ? max.x : min.x,
+					plane.y >= 0 ? max.y : min.y,
+					plane.z >= 0 ? max.z : min.z);
+		if(glm::dot(glm::vec3(plane), p) + plane.w < 0)
+			return false;
+	}
+	return true;
+}
+
+/* World space box of a VAO drawn with the given model matrix */
+bool objectInFrustum (const Frustum& frustum, const struct VAO* vao, const glm::mat4& model)
+{
+	glm::vec3 min(model[3]), max(model[3]);
+	for (int i=0; i<3; i++)
+		for (int j=0; j<3; j++)
+		{
+			float a = model[j][i] * vao->BoundsMin[j];
+			float b = model[j][i] * vao->BoundsMax[j];
+			min[i] += std::min(a, b);
+			max[i] += std::max(a, b);
+		}
+	return boxInFrustum(frustum, min, max);
+}
+
+/* Low resolution depth buffer rasterized on the CPU from a few large occluders - a box that is behind
+   them everywhere it covers the screen is hidden and never reaches GL */
+#define OCCLUSION_WIDTH 256  // multiple of 4 - rows are processed 4 pixels at a time
+#define OCCLUSION_HEIGHT 128
+#define OCCLUSION_NEAR 0.1f  // same as the projection - geometry closer than this is skipped
+
+struct OcclusionBuffer {
+	float depth[OCCLUSION_WIDTH*OCCLUSION_HEIGHT]; // nearest NDC depth of the occluders, 1 where there are none
+	glm::mat4 VP;
+} Occlusion;
+
+/* Start a new frame of occluders seen through the given view-projection */
+void clearOcclusion (const glm::mat4& vp)
+{
+	Occlusion.VP = vp;
+	fill(Occlusion.depth, Occlusion.depth + OCCLUSION_WIDTH*OCCLUSION_HEIGHT, 1.0f);
+}
+
+/* Screen position (x, y) and depth (z) of a point - false when it is too close to the camera */
+bool projectOcclusion (const glm::vec3& p, glm::vec3& screen)
+{
+	glm::vec4 clip = Occlusion.VP * glm::vec4(p, 1);
+	if(clip.w < OCCLUSION_NEAR)
+		return false;
+	screen = glm::vec3((clip.x/clip.w * 0.5f + 0.5f) * OCCLUSION_WIDTH,
+					   (clip.y/clip.w * 0.5f + 0.5f) * OCCLUSION_HEIGHT,
+					   clip.z/clip.w);
+	return true;
+}
+
+/* Keep the nearest depth of the triangle at every pixel center it covers - both windings are drawn */
+void rasterizeOccluderTriangle (glm::vec3 a, glm::vec3 b, glm::vec3 c)
+{
+	float area = (b.x-a.x)*(c.y-a.y) - (b.y-a.y)*(c.x-a.x);
+	if(fabs(area) < 1e-6f)
+		return;
+	if(area < 0)
+	{
+		swap(b, c);
+		area = -area;
+	}
+
+	int minX = max(0, (int)floor(min(a.x, min(b.x, c.x)))) & ~3;
+	int maxX = min(OCCLUSION_WIDTH-1, (int)ceil(max(a.x, max(b.x, c.x))));
+	int minY = max(0, (int)floor(min(a.y, min(b.y, c.y))));
+	int maxY = min(OCCLUSION_HEIGHT-1, (int)ceil(max(a.y, max(b.y, c.y))));
+
+	// edge functions and depth are planes in screen space: value = base + dx*x + dy*y
+	glm::vec3 v[3] = {a, b, c};
+	float edgeDx[3], edgeDy[3], edgeBase[3];
+	for (int i=0; i<3; i++)
+	{
+		const glm::vec3& p = v[(i+1)%3];
+		const glm::vec3& q = v[(i+2)%3];
+		edgeDx[i] = p.y - q.y;
+		edgeDy[i] = q.x - p.x;
+		edgeBase[i] = p.x*q.y - p.y*q.x;
+	}
+	// edge i is proportional to the barycentric weight of vertex i
+	float depthDx = 0, depthDy = 0, depthBase = 0;
+	for (int i=0; i<3; i++)
+	{
+		depthDx += edgeDx[i] * v[i].z / area;
+		depthDy += edgeDy[i] * v[i].z / area;
+		depthBase += edgeBase[i] * v[i].z / area;
+	}
+
+	for (int y=minY; y<=maxY; y++)
+	{
+		float py = y + 0.5f;
+		float* row = &Occlusion.depth[y*OCCLUSION_WIDTH];
+#ifdef __SSE2__
+		const __m128 steps = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+		for (int x=minX; x<=maxX; x+=4)
+		{
+			__m128 px = _mm_add_ps(_mm_set1_ps((float)x), steps);
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (int i=0; i<3; i++)
+			{
+				__m128 e = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edgeDx[i]), px), _mm_set1_ps(edgeDy[i]*py + edgeBase[i]));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(e, _mm_setzero_ps()));
+			}
+			__m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(depthDx), px), _mm_set1_ps(depthDy*py + depthBase));
+			__m128 old = _mm_loadu_ps(&row[x]);
+			__m128 nearest = _mm_min_ps(old, z);
+			_mm_storeu_ps(&row[x], _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+		}
+#else
+		for (int x=minX; x<=maxX; x++)
+		{
+			float px = x + 0.5f;
+			bool inside = true;
+			for (int i=0; i<3; i++)
+				inside = inside && (edgeDx[i]*px + edgeDy[i]*py + edgeBase[i] >= 0);
+			if(inside)
+				row[x] = min(row[x], depthDx*px + depthDy*py + depthBase);
+		}
+#endif
+	}
+}
+
+/* Corners of a box - bit 0 picks x, bit 1 picks y, bit 2 picks z */
+void boxCorners (const glm::vec3& min, const glm::vec3& max, glm::vec3 corners[8])
+{
+	for (int i=0; i<8; i++)
+		corners[i] = glm::vec3((i&1) ? max.x : min.x, (i&2) ? max.y : min.y, (i&4) ? max.z : min.z);
+}
+
+/* Add the 12 triangles of a box to the occlusion buffer - triangles crossing the near plane are left out */
+void rasterizeOccluder (const glm::vec3& min, const glm::vec3& max)
+{
+	glm::vec3 corners[8], screen[8];
+	bool visible[8];
+	boxCorners(min, max, corners);
+	for (int i=0; i<8; i++)
+		visible[i] = projectOcclusion(corners[i], screen[i]);
+
+	// every face as 2 triangles of corner indices
+	const int faces[6][4] = { {0,2,6,4}, {1,5,7,3}, {0,4,5,1}, {2,3,7,6}, {0,1,3,2}, {4,6,7,5} };
+	for (int f=0; f<6; f++)
+	{
+		const int* q = faces[f];
+		if(visible[q[0]] && visible[q[1]] && visible[q[2]])
+			rasterizeOccluderTriangle(screen[q[0]], screen[q[1]], screen[q[2]]);
+		if(visible[q[0]] && visible[q[2]] && visible[q[3]])
+			rasterizeOccluderTriangle(screen[q[0]], screen[q[2]], screen[q[3]]);
+	}
+}
+
+/* True when every pixel the box covers already has an occluder in front of the nearest point of the box */
+bool boxOccluded (const glm::vec3& min, const glm::vec3& max)
+{
+	glm::vec3 corners[8], screen;
+	boxCorners(min, max, corners);
+	float left = OCCLUSION_WIDTH, right = 0, bottom = OCCLUSION_HEIGHT, top = 0, nearest = 1;
+	for (int i=0; i<8; i++)
+	{
+		if(!projectOcclusion(corners[i], screen))
+			return false; // reaches behind the camera
+		left = std::min(left, screen.x);
+		right = std::max(right, screen.x);
+		bottom = std::min(bottom, screen.y);
+		top = std::max(top, screen.y);
+		nearest = std::min(nearest, screen.z);
+	}
+
+	int minX = std::max(0, (int)floor(left)) & ~3;
+	int maxX = std::min(OCCLUSION_WIDTH-1, (int)ceil(right));
+	int minY = std::max(0, (int)floor(bottom));
+	int maxY = std::min(OCCLUSION_HEIGHT-1, (int)ceil(top));
+	if(minX > maxX || minY > maxY)
+		return false; // off screen - left to the frustum test
+
+	for (int y=minY; y<=maxY; y++)
+	{
+		const float* row = &Occlusion.depth[y*OCCLUSION_WIDTH];
+#ifdef __SSE2__
+		__m128 box = _mm_set1_ps(nearest);
+		for (int x=minX; x<=maxX; x+=4)
+			if(_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(&row[x]), box)) != 0)
+				return false;
+#else
+		for (int x=minX; x<=maxX; x++)
+			if(row[x] >= nearest)
+				return false;
+#endif
+	}
+	return true;
+}
+
+/* Objects are collected during the frame and drawn sorted by program, texture and VAO */
+vector<DrawItem> renderQueue;
+
+void submitDraw (ShaderProgram* program, const glm::mat4& model, struct VAO* vao)
+{
+	DrawItem item;
+	item.program = program;
+	item.model = model;
+	item.vao = vao;
+	renderQueue.push_back(item);
+}
+
+/* Submit a single object unless it is outside the view frustum */
+void submitObject (ShaderProgram* program, const glm::mat4& model, struct VAO* vao)
+{
+	if(!objectInFrustum(viewFrustum, vao, model))
+	{
+		Stats.culled++;
+		return;
+	}
+	Stats.visible++;
+	submitDraw(program, model, vao);
+}
+
+bool drawOrder (const DrawItem& a, const DrawItem& b)
+{
+	if(a.program->ProgramID != b.program->ProgramID)
+		return a.program->ProgramID < b.program->ProgramID;
+	if(a.vao->TextureID != b.vao->TextureID)
+		return a.vao->TextureID < b.vao->TextureID;
+	return a.vao->VertexArrayID < b.vao->VertexArrayID;
+}
+
+/* Draw everything submitted this frame - objects sharing state end up next to each other */
+void flushRenderQueue ()
+{
+	stable_sort(renderQueue.begin(), renderQueue.end(), drawOrder);
+
+	// Write the object blocks of the whole frame first - GL sees them in one go
+	for (size_t i=0; i<renderQueue.size(); i++)
+	{
+		DrawItem& item = renderQueue[i];
+		item.objectOffset = -1;
+		if(!finishProgram(item.program)->HasObject)
+			continue;
+		ObjectBlock* block = (ObjectBlock*)ringAlloc(sizeof(ObjectBlock), item.objectOffset);
+		if(block == NULL)
+			continue;
+		block->model = item.model;
+		block->texLayer = item.vao->TextureLayer;
+	}
+	flushRing();
+
+	for (size_t i=0; i<renderQueue.size(); i++)
+	{
+		DrawItem& item = renderQueue[i];
+		if(item.program->HasObject && item.objectOffset < 0)
+			continue; // no room left in the ring
+		useProgram(item.program);
+		// The camera and the object come from the upload ring, only the range is bound here
+		if(item.objectOffset >= 0)
+			glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BINDING, Ring.Buffer, item.objectOffset, sizeof(ObjectBlock));
+
+		if(item.vao->IndirectBuffer != 0)
+			draw3DIndirectObject(item.vao);
+		else if(item.vao->InstanceBuffer != 0)
+			draw3DInstancedObject(item.vao);
+		else if(item.vao->TextureID != 0)
+			draw3DTexturedObject(item.vao);
+		else
+			draw3DObject(item.vao);
+	}
+	renderQueue.clear();
+}
+
+/* Print the frame counters averaged over the last second */
+void reportFrameStats ()
+{
+	static double last_report = glfwGetTime();
+	static int frames = 0;
+	static FrameStats total;
+
+	total.drawCalls += Stats.drawCalls;
+	total.stateCalls += Stats.stateCalls;
+	total.stateElided += Stats.stateElided;
+	total.triangles += Stats.triangles;
+	for (int i=0; i<NUM_LODS; i++)
+		total.lodChunks[i] += Stats.lodChunks[i];
+	total.occluded += Stats.occluded;
+	total.occluderTime += Stats.occluderTime;
+	total.occlusionTestTime += Stats.occlusionTestTime;
+	total.hudTime += Stats.hudTime;
+	total.visible += Stats.visible;
+	total.culled += Stats.culled;
+	Stats = FrameStats();
+	frames++;
+
+	double now = glfwGetTime();
+	if(now - last_report < 1.0)
+		return;
+	ostringstream text;
+	text << "FPS: " << frames / (now - last_report)
+		 << "  draws/frame: " << total.drawCalls / frames
+		 << "  state calls/frame: " << total.stateCalls / frames
+		 << "  elided/frame: " << total.stateElided / frames << "\n"
+		 << "triangles/frame: " << total.triangles / frames
+		 << "  visible/frame: " << total.visible / frames
+		 << "  culled/frame: " << total.culled / frames << "\n"
+		 << "chunks/frame at LOD 0/1/2: " << total.lodChunks[0] / frames << "/" << total.lodChunks[1] / frames
+		 << "/" << total.lodChunks[2] / frames
+		 << "  occluded chunks/frame: " << total.occluded / frames << "\n"
+		 << "occluders ms/frame: " << total.occluderTime / frames
+		 << "  occlusion tests ms/frame: " << total.occlusionTestTime / frames
+		 << "  HUD ms/frame: " << total.hudTime / frames << "\n"
+		 << "text meshes: " << Texts.meshes.size() << " (" << Texts.bytes / 1024 << " KB)"
+		 << "  hits: " << Texts.hits << "  misses: " << Texts.misses << "  evicted: " << Texts.evictions;
+	stats_text = text.str();
+	if(show_stats)
+		cout << stats_text << endl;
+	total = FrameStats();
+	frames = 0;
+	last_report = now;
+}
+
+/* Scale an RGB image to the given size with bilinear filtering */
+void resizeImage (const unsigned char* src, int swidth, int sheight, unsigned char* dst, int dwidth, int dheight)
+{
+	for (int y=0; y<dheight; y++)
+	{
+		float fy = (y + 0.5f) * sheight / dheight - 0.5f;
+		int y0 = max(0, min(sheight-1, (int)floor(fy)));
+		int y1 = min(sheight-1, y0+1);
+		float wy = max(0.0f, min(1.0f, fy - y0));
+		for (int x=0; x<dwidth; x++)
+		{
+			float fx = (x + 0.5f) * swidth / dwidth - 0.5f;
+			int x0 = max(0, min(swidth-1, (int)floor(fx)));
+			int x1 = min(swidth-1, x0+1);
+			float wx = max(0.0f, min(1.0f, fx - x0));
+			for (int c=0; c<3; c++)
+			{
+				float top = src[3*(y0*swidth+x0)+c]*(1-wx) + src[3*(y0*swidth+x1)+c]*wx;
+				float bot = src[3*(y1*swidth+x0)+c]*(1-wx) + src[3*(y1*swidth+x1)+c]*wx;
+				dst[3*(y*dwidth+x)+c] = (unsigned char)(top*(1-wy) + bot*wy + 0.5f);
+			}
+		}
+	}
+}
+
+
+/* Decode an image file and scale it to a material layer - texture coordinates stay the same.
+   SOIL keeps its result string and stb_image's failure reason in globals, so only one worker
+   decodes at a time - scaling and compressing the layers still run in parallel */
+bool loadMaterialImage (const char* filename, unsigned char* layer)
+{
+	static mutex decoding;
+	int twidth, theight;
+	Asset file;
+	loadAsset(filename, file);
+	unsigned char* image;
+	{
+		lock_guard<mutex> guard(decoding);
+		image = file.data ? SOIL_load_image_from_memory(file.data, file.size, &twidth, &theight, 0, SOIL_LOAD_RGB) : NULL;
+		if(image == NULL)
+		{
+			cout << "SOIL loading error: '" << filename << "' " << SOIL_last_result() << endl;
+			return false;
+		}
+	}
+	resizeImage(image, twidth, theight, layer, MATERIAL_SIZE, MATERIAL_SIZE);
+	SOIL_free_image_data(image); // Free the data read from file after scaling it
+	Startup.texturesDecoded++;
+	return true;
+}
+
+/* Next mip level of a square RGB image - each pixel is the average of 2x2 */
+void downsampleImage (const unsigned char* src, int size, unsigned char* dst)
+{
+	int half = max(size/2, 1);
+	for (int y=0; y<half; y++)
+		for (int x=0; x<half; x++)
+			for (int c=0; c<3; c++)
+			{
+				int x1 = min(2*x+1, size-1), y1 = min(2*y+1, size-1);
+				int sum = src[3*(2*y*size+2*x)+c] + src[3*(2*y*size+x1)+c] + src[3*(y1*size+2*x)+c] + src[3*(y1*size+x1)+c];
+				dst[3*(y*half+x)+c] = (sum + 2) / 4;
+			}
+}
+
+GLushort packRGB565 (const float* color)
+{
+	int r = (int)(std::min(std::max(color[0], 0.0f), 255.0f) * 31 / 255 + 0.5f);
+	int g = (int)(std::min(std::max(color[1], 0.0f), 255.0f) * 63 / 255 + 0.5f);
+	int b = (int)(std::min(std::max(color[2], 0.0f), 255.0f) * 31 / 255 + 0.5f);
+	return (r << 11) | (g << 5) | b;
+}
+
+void unpackRGB565 (GLushort packed, float* color)
+{
+	color[0] = ((packed >> 11) & 31) * 255 / 31.0f;
+	color[1] = ((packed >> 5) & 63) * 255 / 63.0f;
+	color[2] = (packed & 31) * 255 / 31.0f;
+}
+
+/* Encode 4x4 RGB pixels into an 8 byte BC1 block - the end points are the extremes of the pixels
+   along their principal axis, every pixel then takes the nearest of the 4 colors */
+void encodeBC1Block (const unsigned char pixels[16][3], unsigned char* block)
+{
+	float mean[3] = {0, 0, 0};
+	for (int i=0; i<16; i++)
+		for (int c=0; c<3; c++)
+			mean[c] += pixels[i][c] / 16.0f;
+	float covariance[6] = {0, 0, 0, 0, 0, 0}; // rr rg rb gg gb bb
+	for (int i=0; i<16; i++)
+	{
+		float d[3] = { pixels[i][0]-mean[0], pixels[i][1]-mean[1], pixels[i][2]-mean[2] };
+		covariance[0] += d[0]*d[0]; covariance[1] += d[0]*d[1]; covariance[2] += d[0]*d[2];
+		covariance[3] += d[1]*d[1]; covariance[4] += d[1]*d[2]; covariance[5] += d[2]*d[2];
+	}
+	// A few power iterations are enough to find the main direction of the colors
+	float axis[3] = {1, 1, 1};
+	for (int k=0; k<4; k++)
+	{
+		float next[3] = {
+			covariance[0]*axis[0] + covariance[1]*axis[1] + covariance[2]*axis[2],
+			covariance[1]*axis[0] + covariance[3]*axis[1] + covariance[4]*axis[2],
+			covariance[2]*axis[0] + covariance[4]*axis[1] + covariance[5]*axis[2] };
+		float length = max(max(fabsf(next[0]), fabsf(next[1])), fabsf(next[2]));
+		if(length < 1e-6f)
+			break; // flat block
+		for (int c=0; c<3; c++)
+			axis[c] = next[c] / length;
+	}
+	int lowest = 0, highest = 0;
+	float low = 1e30f, high = -1e30f;
+	for (int i=0; i<16; i++)
+	{
+		float t = pixels[i][0]*axis[0] + pixels[i][1]*axis[1] + pixels[i][2]*axis[2];
+		if(t < low) { low = t; lowest = i; }
+		if(t > high) { high = t; highest = i; }
+	}
+	float end0[3] = { (float)pixels[highest][0], (float)pixels[highest][1], (float)pixels[highest][2] };
+	float end1[3] = { (float)pixels[lowest][0], (float)pixels[lowest][1], (float)pixels[lowest][2] };
+	GLushort color0 = packRGB565(end0), color1 = packRGB565(end1);
+	if(color0 < color1)
+		swap(color0, color1); // color0 > color1 selects the 4 color mode
+
+	float palette[4][3];
+	unpackRGB565(color0, palette[0]);
+	unpackRGB565(color1, palette[1]);
+	for (int c=0; c<3; c++)
+	{
+		palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+	}
+	GLuint indices = 0;
+	if(color0 != color1) // equal end points leave every index at color0
+		for (int i=0; i<16; i++)
+		{
+			int best = 0;
+			float bestDistance = 1e30f;
+			for (int p=0; p<4; p++)
+			{
+				float dr = pixels[i][0]-palette[p][0], dg = pixels[i][1]-palette[p][1], db = pixels[i][2]-palette[p][2];
+				float distance = dr*dr + dg*dg + db*db;
+				if(distance < bestDistance)
+				{
+					bestDistance = distance;
+					best = p;
+				}
+			}
+			indices |= best << (2*i);
+		}
+	block[0] = color0 & 0xFF; block[1] = color0 >> 8;
+	block[2] = color1 & 0xFF; block[3] = color1 >> 8;
+	for (int i=0; i<4; i++)
+		block[4+i] = (indices >> (8*i)) & 0xFF;
+}
+
+/* Bytes of one BC1 mip level of a layer - levels below 4x4 still take a whole block */
+size_t bc1LevelSize (int size)
+{
+	int blocks = (size + 3) / 4;
+	return blocks * blocks * 8;
+}
+
+/* Encode a square RGB image into BC1 blocks, row by row - edges of small levels are clamped */
+void compressBC1 (const unsigned char* image, int size, unsigned char* out)
+{
+	unsigned char pixels[16][3];
+	for (int by=0; by<size; by+=4)
+		for (int bx=0; bx<size; bx+=4)
+		{
+			for (int i=0; i<16; i++)
+			{
+				int x = min(bx + i%4, size-1), y = min(by + i/4, size-1);
+				for (int c=0; c<3; c++)
+					pixels[i][c] = image[3*(y*size+x)+c];
+			}
+			encodeBC1Block(pixels, out);
+			out += 8;
+		}
+}
+
+/* Names of the source images with their packed hash, or the size and time of the loose file -
+   a cache cooked from other images is stale. Nothing is read to check it */
+string materialSignature (const char** filenames, int count)
+{
+	ostringstream signature;
+	signature << MATERIAL_SIZE << " " << MATERIAL_LEVELS << "\n";
+	for (int i=0; i<count; i++)
+	{
+		long long size = 0, time = 0;
+		if(const BundleEntry* entry = bundleEntry(filenames[i]))
+			signature << filenames[i] << " packed " << entry->hash << "\n";
+		else
+		{
+			fileStamp(filenames[i], size, time); // stays 0 0 when the image is missing
+			signature << filenames[i] << " " << size << " " << time << "\n";
+		}
+	}
+	return signature.str();
+}
+
+/* Read the cooked mip levels (all layers of level 0, then of level 1...) if the cache matches */
+bool loadMaterialCache (const string& signature, int count, vector< vector<unsigned char> >& levels)
+{
+	ifstream file(MATERIAL_CACHE, ios::in | ios::binary);
+	if(!file.is_open())
+		return false;
+	char magic[8];
+	GLuint length = 0;
+	file.read(magic, sizeof(magic));
+	file.read((char*)&length, sizeof(length));
+	if(!file || memcmp(magic, MATERIAL_CACHE_MAGIC, sizeof(magic)) != 0 || length != signature.size())
+		return false;
+	string stored(length, ' ');
+	file.read(&stored[0], length);
+	Startup.bytesRead += sizeof(magic) + sizeof(length) + file.gcount();
+	if(!file || stored != signature)
+		return false;
+
+	levels.resize(MATERIAL_LEVELS);
+	for (int level=0; level<MATERIAL_LEVELS; level++)
+	{
+		levels[level].resize(bc1LevelSize(max(MATERIAL_SIZE >> level, 1)) * count);
+		file.read((char*)&levels[level][0], levels[level].size());
+		Startup.bytesRead += file.gcount();
+	}
+	return (bool)file;
+}
+
+void saveMaterialCache (const string& signature, const vector< vector<unsigned char> >& levels)
+{
+	ofstream file(MATERIAL_CACHE, ios::out | ios::binary | ios::trunc);
+	GLuint length = signature.size();
+	file.write(MATERIAL_CACHE_MAGIC, 8);
+	file.write((const char*)&length, sizeof(length));
+	file.write(signature.data(), length);
+	for (size_t level=0; level<levels.size(); level++)
+		file.write((const char*)&levels[level][0], levels[level].size());
+	if(!file)
+		cout << "Error: could not write '" << MATERIAL_CACHE << "'" << endl;
+}
+
+/* Bytes of one mip level of a layer in the format of the material array */
+size_t materialLevelSize (int size)
+{
+	return Materials.Compressed ? bc1LevelSize(size) : 3*size*size;
+}
+
+/* Decode one image, build its mip chain and write every level (BC1 when compressed) into its
+   place in the levels - runs on the workers, each layer only touches its own bytes */
+void cookLayer (const char* filename, int layer, vector< vector<unsigned char> >& levels)
+{
+	vector<unsigned char> image(3*MATERIAL_SIZE*MATERIAL_SIZE), smaller(image.size());
+	if(!loadMaterialImage(filename, &image[0]))
+		fill(image.begin(), image.end(), 0);
+	int size = MATERIAL_SIZE;
+	for (int level=0; level<MATERIAL_LEVELS; level++)
+	{
+		unsigned char* out = &levels[level][layer * materialLevelSize(size)];
+		if(Materials.Compressed)
+			compressBC1(&image[0], size, out);
+		else
+			memcpy(out, &image[0], materialLevelSize(size));
+		downsampleImage(&image[0], size, &smaller[0]);
+		image.swap(smaller);
+		size = max(size/2, 1);
+	}
+}
+
+/* Worker of the loader - cooks layers until none are left and hands each one to the main thread */
+void materialWorker ()
+{
+	for (int layer = Loader.next++; layer < (int)Loader.filenames.size(); layer = Loader.next++)
+	{
+		cookLayer(Loader.filenames[layer].c_str(), layer, Loader.levels);
+		lock_guard<mutex> guard(Loader.lock);
+		Loader.ready.push_back(layer);
+	}
+}
+
+/* Upload the levels of one layer through the pixel unpack buffer - the buffer is orphaned first
+   so the copy never waits for the GPU to finish with the previous layer */
+void uploadLayer (int layer)
+{
+	size_t bytes = 0;
+	for (int level=0; level<MATERIAL_LEVELS; level++)
+		bytes += materialLevelSize(max(MATERIAL_SIZE >> level, 1));
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, Loader.PixelBuffer);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+	unsigned char* mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if(mapped != NULL)
+	{
+		size_t offset = 0;
+		for (int level=0; level<MATERIAL_LEVELS; level++)
+		{
+			int size = max(MATERIAL_SIZE >> level, 1);
+			memcpy(mapped + offset, &Loader.levels[level][layer * materialLevelSize(size)], materialLevelSize(size));
+			offset += materialLevelSize(size);
+		}
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		bindTextureArray(Materials.TextureID);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		offset = 0;
+		for (int level=0; level<MATERIAL_LEVELS; level++)
+		{
+			int size = max(MATERIAL_SIZE >> level, 1);
+			if(Materials.Compressed)
+				glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, size, size, 1, GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+						materialLevelSize(size), (void*)offset);
+			else
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, size, size, 1, GL_RGB, GL_UNSIGNED_BYTE, (void*)offset);
+			offset += materialLevelSize(size);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // other uploads read client memory
+}
+
+/* Called once per frame - swaps the placeholders for the layers the workers have finished */
+void streamMaterials ()
+{
+	if(Loader.workers.empty())
+		return;
+	vector<int> ready;
+	{
+		lock_guard<mutex> guard(Loader.lock);
+		ready.swap(Loader.ready);
+	}
+	for (size_t i=0; i<ready.size(); i++)
+		uploadLayer(ready[i]);
+	Loader.uploaded += ready.size();
+	if(Loader.uploaded < (int)Loader.filenames.size())
+		return;
+
+	joinMaterialWorkers();
+	endPhase(Loader.phase);
+	glDeleteBuffers(1, &Loader.PixelBuffer);
+	if(Materials.Compressed)
+		saveMaterialCache(Loader.signature, Loader.levels);
+	cout << "Materials: " << Loader.uploaded << " layers streamed in " << (glfwGetTime() - Loader.start) * 1000 << " ms" << endl;
+	vector< vector<unsigned char> >().swap(Loader.levels);
+}
+
+/* Create an OpenGL Texture Array from a list of images - image i becomes layer i. It starts out
+   gray, the images are decoded by workers and streamed in by streamMaterials while the game runs */
+GLuint createTextureArray (const char** filenames, int count)
+{
+	GLuint TextureID;
+	// Generate Texture Buffer
+	glGenTextures(1, &TextureID);
+	Startup.glObjects++;
+	// All upcoming GL_TEXTURE_2D_ARRAY operations now have effect on our texture buffer
+	bindTextureArray(TextureID);
+	// Set our texture parameters
+	// Set texture wrapping to GL_REPEAT
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	// Set texture filtering (interpolation)
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, MATERIAL_LEVELS-1);
+
+	// Every level of every layer comes ready made from the cache when it matches the images
+	Materials.Compressed = GLAD_GL_EXT_texture_compression_s3tc;
+	Loader.start = glfwGetTime();
+	Loader.signature = Materials.Compressed ? materialSignature(filenames, count) : "";
+	bool cached = Materials.Compressed && loadMaterialCache(Loader.signature, count, Loader.levels);
+	if(cached)
+		cout << "Materials: loaded from '" << MATERIAL_CACHE << "'" << endl;
+	else
+	{
+		// Gray placeholders until the workers are done - a gray BC1 block is just one color
+		unsigned char gray[16][3], block[8];
+		memset(gray, 128, sizeof(gray));
+		encodeBC1Block(gray, block);
+		Loader.levels.assign(MATERIAL_LEVELS, vector<unsigned char>());
+		for (int level=0; level<MATERIAL_LEVELS; level++)
+		{
+			Loader.levels[level].resize(materialLevelSize(max(MATERIAL_SIZE >> level, 1)) * count, 128);
+			if(Materials.Compressed)
+				for (size_t i=0; i<Loader.levels[level].size(); i++)
+					Loader.levels[level][i] = block[i % 8];
+		}
+	}
+
+	// Allocate all layers and levels with what there is so far
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int level=0; level<MATERIAL_LEVELS; level++)
+	{
+		int size = max(MATERIAL_SIZE >> level, 1);
+		if(Materials.Compressed)
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, size, size, count, 0,
+					Loader.levels[level].size(), &Loader.levels[level][0]);
+		else
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGB, size, size, count, 0, GL_RGB, GL_UNSIGNED_BYTE, &Loader.levels[level][0]);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	if(cached)
+		vector< vector<unsigned char> >().swap(Loader.levels);
+	else
+	{
+		if(Materials.Compressed)
+			cout << "Materials: cooking '" << MATERIAL_CACHE << "'" << endl;
+		Loader.filenames.assign(filenames, filenames + count);
+		Loader.next = 0;
+		Loader.uploaded = 0;
+		glGenBuffers(1, &Loader.PixelBuffer);
+		Startup.glObjects++;
+		Loader.phase = beginPhase("materials (background)", true);
+		int workers = min(count, max(1, (int)thread::hardware_concurrency() - 1)); // the main thread keeps drawing
+		for (int i=0; i<workers; i++)
+			Loader.workers.push_back(thread(materialWorker));
+	}
+
+	// The array is left bound : no other texture is ever used, so draws never rebind it
+	return TextureID;
+}
+
+/* Register every material of the scene and start loading them into the material array */
+void createMaterials (const char** filenames, int count)
+{
+	Materials.TextureID = createTextureArray(filenames, count);
+	Materials.NumLayers = count;
+	for (int i=0; i<count; i++)
+	{
+		Resources.textureMisses++;
+		Resources.layers[filenames[i]] = i;
+	}
+}
+
+/* Returns the material array layer of an image file */
+int getTextureLayer (const char* filename)
 {
-	GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-	for (int i=0; i<numVertices; i++) {
-		color_buffer_data [3*i] = red;
-		color_buffer_data [3*i + 1] = green;
-		color_buffer_data [3*i + 2] = blue;
+	map<string, int>::iterator it = Resources.layers.find(filename);
+	if(it != Resources.layers.end())
+	{
+		Resources.textureHits++;
+		return it->second;
 	}
 
-	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+	cout << "Error: '" << filename << "' is not in the material array" << endl;
+	return 0;
 }
 
-struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, GLuint textureID, GLenum fill_mode=GL_FILL)
+/* Returns a textured l*b*h box mesh, building its VBOs on first use */
+/* The returned VAO is shared - copy it before setting a TextureLayer */
+struct VAO* getCubeMesh (float l, float b, float h, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data)
 {
-	struct VAO* vao = new struct VAO;
-	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
-	vao->FillMode = fill_mode;
-	vao->TextureID = textureID;
-
-	// Create Vertex Array Object
-	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->TextureBuffer));  // VBO - textures
+	tuple<float,float,float> key(l, b, h);
+	map< tuple<float,float,float>, struct VAO* >::iterator it = Resources.meshes.find(key);
+	if(it != Resources.meshes.end())
+	{
+		Resources.meshHits++;
+		return it->second;
+	}
 
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-	glVertexAttribPointer(
-						  0,                  // attribute 0. Vertices
-						  3,                  // size (x,y,z)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
-
-	glBindBuffer (GL_ARRAY_BUFFER, vao->TextureBuffer); // Bind the VBO textures
-	glBufferData (GL_ARRAY_BUFFER, 2*numVertices*sizeof(GLfloat), texture_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-	glVertexAttribPointer(
-						  2,                  // attribute 2. Textures
-						  2,                  // size (s,t)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
+	Resources.meshMisses++;
+	struct VAO* mesh = create3DTexturedObject(GL_TRIANGLES, 36, vertex_buffer_data, texture_buffer_data, 0, GL_FILL);
+	Resources.meshes[key] = mesh;
+	return mesh;
+}
 
-	return vao;
+void printResourceStats ()
+{
+	cout << "Textures: " << Resources.layers.size() << " layers, "
+		 << Resources.textureHits << " hits, " << Resources.textureMisses << " misses" << endl;
+	cout << "Meshes: " << Resources.meshes.size() << " built, "
+		 << Resources.meshHits << " hits, " << Resources.meshMisses << " misses" << endl;
+	cout << "Programs: " << Programs.hits + Programs.misses << " in " << Programs.time << " ms, "
+		 << Programs.hits << " from binaries, " << Programs.misses << " compiled"
+		 << (Programs.parallel ? " in parallel" : "") << ", " << sceneVariants.size() << " scene variants" << endl;
+	cout << "Vertices: " << Resources.vertexBytes / 1024 << " KB (" << Resources.floatVertexBytes / 1024 << " KB as floats)" << endl;
+	cout << "Text meshes: " << Texts.meshes.size() << " cached, " << Texts.bytes / 1024 << " KB, "
+		 << Texts.hits << " hits, " << Texts.misses << " misses, " << Texts.evictions << " evicted" << endl;
+}
+/* Startup phases as a table - called once the first frame is shown and the materials are in */
+void printStartupReport ()
+{
+	double total = chrono::duration<double, milli>(chrono::steady_clock::now() - Startup.start).count();
+	cout << "Startup: " << total << " ms to the first full frame" << endl;
+	for (size_t i=0; i<Startup.phases.size(); i++)
+	{
+		const StartupPhase& phase = Startup.phases[i];
+		char line[160];
+		snprintf(line, sizeof(line), "  %*s%-*s %9.1f ms %8zu KB %3d textures %4d GL objects",
+		         phase.depth * 2, "", 28 - phase.depth * 2, phase.name.c_str(),
+		         phase.ms, phase.bytesRead / 1024, phase.texturesDecoded, phase.glObjects);
+		cout << line << endl;
+	}
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* The same report as JSON, one phase per line so compareStartups can read it back */
+bool writeStartupReport (const char* filename)
 {
-	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	FILE* file = fopen(filename, "w");
+	if(!file)
+	{
+		cout << "Error: Could not write '" << filename << "'" << endl;
+		return false;
+	}
+	double total = chrono::duration<double, milli>(chrono::steady_clock::now() - Startup.start).count();
+	fprintf(file, "{\n\"total_ms\": %.3f,\n\"phases\": [\n", total);
+	for (size_t i=0; i<Startup.phases.size(); i++)
+	{
+		const StartupPhase& phase = Startup.phases[i];
+		fprintf(file, "  {\"name\": \"%s\", \"depth\": %d, \"ms\": %.3f, \"bytes\": %zu, \"textures\": %d, \"gl_objects\": %d}%s\n",
+		        phase.name.c_str(), phase.depth, phase.ms, phase.bytesRead, phase.texturesDecoded, phase.glObjects,
+		        i+1 < Startup.phases.size() ? "," : "");
+	}
+	fprintf(file, "]\n}\n");
+	fclose(file);
+	return true;
+}
 
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+/* Reads back a report of writeStartupReport */
+bool readStartupReport (const char* filename, double& total, vector<StartupPhase>& phases)
+{
+	FILE* file = fopen(filename, "r");
+	if(!file)
+		return false;
+	char line[512], name[128];
+	total = -1;
+	while (fgets(line, sizeof(line), file))
+	{
+		StartupPhase phase;
+		if(sscanf(line, "\"total_ms\": %lf", &total) == 1)
+			continue;
+		if(sscanf(line, " {\"name\": \"%127[^\"]\", \"depth\": %d, \"ms\": %lf, \"bytes\": %zu, \"textures\": %d, \"gl_objects\": %d",
+		          name, &phase.depth, &phase.ms, &phase.bytesRead, &phase.texturesDecoded, &phase.glObjects) != 6)
+			continue;
+		phase.name = name;
+		phases.push_back(phase);
+	}
+	fclose(file);
+	return total >= 0;
+}
 
-	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+/* Starts the game twice, without and then with the material and program caches, and prints
+   where the two starts differ - the bundle is kept, it is packed by hand */
+void compareStartups (int argc, char** argv)
+{
+	remove(MATERIAL_CACHE);
+	if(DIR* dir = opendir(PROGRAM_CACHE))
+	{
+		while (dirent* entry = readdir(dir))
+			if(entry->d_name[0] != '.')
+				remove((string(PROGRAM_CACHE) + "/" + entry->d_name).c_str());
+		closedir(dir);
+	}
 
-	// Enable Vertex Attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+	// the other options are passed on as they are, so both starts load the same board
+	const char* reports[] = { "startup-cold.json", "startup-warm.json" };
+	vector<char*> arguments;
+	arguments.push_back(argv[0]);
+	arguments.push_back((char*)"--startup-report");
+	arguments.push_back(NULL); // the report of each run
+	for (int i=1; i<argc; i++)
+		if(string(argv[i]) != "--compare-startup")
+			arguments.push_back(argv[i]);
+	arguments.push_back(NULL);
+	double totals[2];
+	vector<StartupPhase> phases[2];
+	for (int run=0; run<2; run++)
+	{
+		cout << "Startup: " << (run == 0 ? "cold" : "warm") << " start" << endl;
+		arguments[2] = (char*)reports[run];
+		int status = -1;
+		pid_t child = fork();
+		if(child == 0)
+		{
+			execv("/proc/self/exe", &arguments[0]); // this same binary, whatever argv[0] says
+			_exit(127);
+		}
+		if(child > 0)
+			waitpid(child, &status, 0);
+		if(status != 0 || !readStartupReport(reports[run], totals[run], phases[run]))
+		{
+			cout << "Error: The " << (run == 0 ? "cold" : "warm") << " start did not write '" << reports[run] << "'" << endl;
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+	cout << "Startup: cold against warm, phases are matched by name" << endl;
+	char line[160];
+	snprintf(line, sizeof(line), "  %-28s %10s %10s %10s %10s", "", "cold ms", "warm ms", "saved ms", "cold KB");
+	cout << line << endl;
+	for (size_t i=0; i<phases[0].size(); i++)
+	{
+		const StartupPhase& cold = phases[0][i];
+		const StartupPhase* warm = NULL;
+		for (size_t j=0; j<phases[1].size() && !warm; j++)
+			if(phases[1][j].name == cold.name)
+				warm = &phases[1][j];
+		snprintf(line, sizeof(line), "  %*s%-*s %10.1f %10.1f %10.1f %10zu",
+		         cold.depth * 2, "", 28 - cold.depth * 2, cold.name.c_str(),
+		         cold.ms, warm ? warm->ms : 0.0, warm ? cold.ms - warm->ms : cold.ms, cold.bytesRead / 1024);
+		cout << line << endl;
+	}
+	snprintf(line, sizeof(line), "  %-28s %10.1f %10.1f %10.1f", "total", totals[0], totals[1], totals[0] - totals[1]);
+	cout << line << endl;
 }
 
-void draw3DTexturedObject (struct VAO* vao)
+/* Use the font program for FTGL - FTGL is told where its inputs are the first time, which is
+   when the program has to be linked */
+void useFontProgram ()
 {
-	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
-
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+	static bool located = false;
+	useProgram(fontProgram);
+	if(located)
+		return;
+	located = true;
+	GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
+	fontVertexCoordAttrib = glGetAttribLocation(fontProgram->ProgramID, "vertexPosition");
+	fontVertexNormalAttrib = glGetAttribLocation(fontProgram->ProgramID, "vertexNormal");
+	fontVertexOffsetUniform = uniformLocation(fontProgram, "pen");
+	GL3Font.font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
+}
 
-	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+/* FNV-1a over the text and the size and depth it is extruded with */
+unsigned long long textHash (const string& text, unsigned int size, float depth)
+{
+	unsigned long long hash = fnv1a(text.data(), text.size());
+	hash = fnv1a(&size, sizeof(size), hash);
+	return fnv1a(&depth, sizeof(depth), hash);
+}
 
-	// Bind Textures using texture units
-	glBindTexture(GL_TEXTURE_2D, vao->TextureID);
+/* Let FTGL render the string once with transform feedback on and keep what it drew as a mesh */
+struct VAO* captureText (const string& text, unsigned int size, float depth)
+{
+	GL3Font.font->FaceSize(size);
+	GL3Font.font->Depth(depth);
+
+	GLuint feedback, queries[2];
+	glGenBuffers(1, &feedback);
+	glGenQueries(2, queries);
+	Startup.glObjects += 3;
+	GLuint capacity = max((size_t)1, text.size()) * TEXT_TRIANGLES_PER_CHAR;
+	GLuint generated = 0, written = 0;
+	glm::vec3 white(1, 1, 1);
+	useFontProgram();
+	glEnable(GL_RASTERIZER_DISCARD);
+	for (int attempt=0; attempt<2; attempt++)
+	{
+		glBindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, feedback);
+		glBufferData(GL_TRANSFORM_FEEDBACK_BUFFER, capacity * 3 * 6*sizeof(GLfloat), NULL, GL_STREAM_READ);
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, feedback);
+		bindObjectBlock(glm::mat4(1.0f), &white[0], 0);
+		glBeginQuery(GL_PRIMITIVES_GENERATED, queries[0]);
+		glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, queries[1]);
+		glBeginTransformFeedback(GL_TRIANGLES);
+		GL3Font.font->Render(text.c_str());
+		glEndTransformFeedback();
+		glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
+		glEndQuery(GL_PRIMITIVES_GENERATED);
+		invalidateGLState();
+		useFontProgram();
+		glGetQueryObjectuiv(queries[0], GL_QUERY_RESULT, &generated);
+		glGetQueryObjectuiv(queries[1], GL_QUERY_RESULT, &written);
+		if(written == generated)
+			break;
+		capacity = generated; // the buffer was too small, now the size is known
+	}
+	glDisable(GL_RASTERIZER_DISCARD);
 
-	// Enable Vertex Attribute 2 - Texture
-	glEnableVertexAttribArray(2);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->TextureBuffer);
+	// Weld the triangle soup into an indexed mesh like every other object
+	vector<GLfloat> triangles(written * 3 * 6);
+	if(!triangles.empty())
+	{
+		glBindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, feedback);
+		glGetBufferSubData(GL_TRANSFORM_FEEDBACK_BUFFER, 0, triangles.size()*sizeof(GLfloat), &triangles[0]);
+	}
+	glDeleteBuffers(1, &feedback);
+	glDeleteQueries(2, queries);
 
-	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+	GL3Font.font->FaceSize(1);
+	GL3Font.font->Depth(0);
 
-	// Unbind Textures to be safe
-	glBindTexture(GL_TEXTURE_2D, 0);
+	if(triangles.empty())
+		return NULL; // only spaces
+	MeshBuilder mesh;
+	initMesh(mesh, &fontVertexFormat);
+	for (size_t i=0; i<triangles.size(); i+=6)
+	{
+		if(mesh.vertices.size() / mesh.components >= 0x10000)
+		{
+			cout << "Warning: '" << text << "' has too many vertices for 16 bit indices, it is not cached" << endl;
+			return NULL;
+		}
+		addVertex(mesh, &triangles[i]);
+	}
+	return create3DIndexedObject(GL_TRIANGLES, mesh);
 }
 
-/* Create an OpenGL Texture from an image */
-GLuint createTexture (const char* filename)
+/* Mesh of an extruded string - tessellated on the first use, then taken from the cache.
+   NULL when the string has no mesh of its own, it is then rendered by FTGL every time */
+struct VAO* getTextMesh (const string& text, unsigned int size, float depth)
 {
-	GLuint TextureID;
-	// Generate Texture Buffer
-	glGenTextures(1, &TextureID);
-	// All upcoming GL_TEXTURE_2D operations now have effect on our texture buffer
-	glBindTexture(GL_TEXTURE_2D, TextureID);
-	// Set our texture parameters
-	// Set texture wrapping to GL_REPEAT
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	// Set texture filtering (interpolation)
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	unsigned long long hash = textHash(text, size, depth);
+	map<unsigned long long, TextMesh>::iterator it = Texts.meshes.find(hash);
+	if(it != Texts.meshes.end() && it->second.text == text && it->second.size == size && it->second.depth == depth)
+	{
+		Texts.hits++;
+		Texts.recent.splice(Texts.recent.begin(), Texts.recent, it->second.recent);
+		return it->second.vao;
+	}
+	Texts.misses++;
+	if(it != Texts.meshes.end())
+		return NULL; // hash collision - leave the cached one alone
+
+	// Strings without a mesh (only spaces, or too big) are kept too, so they are not captured again
+	struct VAO* vao = captureText(text, size, depth);
+	TextMesh& entry = Texts.meshes[hash];
+	entry.text = text;
+	entry.size = size;
+	entry.depth = depth;
+	entry.vao = vao;
+	entry.bytes = vao ? vao->NumVertices*fontVertexFormat.Stride + vao->NumIndices*sizeof(GLushort) : 0;
+	Texts.recent.push_front(hash);
+	entry.recent = Texts.recent.begin();
+	Texts.bytes += entry.bytes;
+
+	// Drop the least recently drawn strings, never the one just built
+	while(Texts.bytes > TEXT_CACHE_BYTES && Texts.recent.size() > 1)
+	{
+		map<unsigned long long, TextMesh>::iterator oldest = Texts.meshes.find(Texts.recent.back());
+		Texts.bytes -= oldest->second.bytes;
+		if(oldest->second.vao)
+			delete3DObject(oldest->second.vao);
+		Texts.meshes.erase(oldest);
+		Texts.recent.pop_back();
+		Texts.evictions++;
+	}
+	return vao;
+}
 
-	// Load image and create OpenGL texture
-	int twidth, theight;
-	unsigned char* image = SOIL_load_image(filename, &twidth, &theight, 0, SOIL_LOAD_RGB);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, twidth, theight, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-	glGenerateMipmap(GL_TEXTURE_2D); // Generate MipMaps to use
-	SOIL_free_image_data(image); // Free the data read from file after creating opengl texture
-	glBindTexture(GL_TEXTURE_2D, 0); // Unbind texture when done, so we won't accidentily mess it up
+/* Draw 3D text in the world - FTGL extrudes the string once, then it is drawn from the cache */
+void drawText3D (const string& text, const glm::vec3& position, unsigned int size, float depth, const glm::vec3& color)
+{
+	struct VAO* vao = getTextMesh(text, size, depth);
+	glm::mat4 model = glm::translate(position);
+	if(vao == NULL)
+	{
+		// Not cached - FTGL renders it with the same program and transform
+		useFontProgram();
+		if(!bindObjectBlock(model, &color[0], 0))
+			return;
+		GL3Font.font->FaceSize(size);
+		GL3Font.font->Depth(depth);
+		GL3Font.font->Render(text.c_str());
+		GL3Font.font->FaceSize(1);
+		GL3Font.font->Depth(0);
+		invalidateGLState();
+		return;
+	}
+	if(!objectInFrustum(viewFrustum, vao, model))
+	{
+		Stats.culled++;
+		return;
+	}
+	Stats.visible++;
 
-	return TextureID;
+	useProgram(fontProgram);
+	glUniform3f(uniformLocation(fontProgram, "pen"), 0, 0, 0); // FTGL moves the pen per glyph, the mesh already has it
+	if(!bindObjectBlock(model, &color[0], 0))
+		return;
+	draw3DObject(vao);
 }
-void drawFont(const char *c,float x,float y,float z,int color,int effect)
-{
-  glm::mat4 MVP;  // MVP = Projection * View * Model
 
-  static int fontScale = 0;
-  float fontScaleValue = 0.75;
-  static int color_val=4;
-  if(color==1)
-   color_val = (color_val+1) % 360;
-  glm::vec3 fontColor = getRGBfromHue (color_val);
+/* Rasterize the printable ASCII glyphs of the font into the atlas and set up the HUD buffers */
+void initHud (const char* fontfile, const Asset& font)
+{
+	FT_Library library;
+	FT_Face face;
+	if(FT_Init_FreeType(&library) || FT_New_Memory_Face(library, font.data, font.size, 0, &face))
+	{
+		cout << "Error: Could not load HUD font `" << fontfile << "'" << endl;
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+	FT_Set_Pixel_Sizes(face, 0, HUD_FONT_SIZE);
+	Hud.ascent = face->size->metrics.ascender >> 6;
+	Hud.lineHeight = face->size->metrics.height >> 6;
+
+	// Glyphs are packed left to right in rows, with a pixel of space so filtering never bleeds
+	vector<unsigned char> atlas(HUD_ATLAS_SIZE*HUD_ATLAS_SIZE, 0);
+	memset(Hud.glyphs, 0, sizeof(Hud.glyphs));
+	int x = 1, y = 1, rowHeight = 0;
+	for (int c=32; c<127; c++)
+	{
+		if(FT_Load_Char(face, c, FT_LOAD_RENDER))
+			continue;
+		FT_GlyphSlot slot = face->glyph;
+		int width = slot->bitmap.width, height = slot->bitmap.rows;
+		if(x + width + 1 > HUD_ATLAS_SIZE)
+		{
+			x = 1;
+			y += rowHeight + 1;
+			rowHeight = 0;
+		}
+		if(y + height + 1 > HUD_ATLAS_SIZE)
+		{
+			cout << "Error: HUD glyph atlas is full, raise HUD_ATLAS_SIZE" << endl;
+			break;
+		}
+		for (int row=0; row<height; row++)
+			memcpy(&atlas[(y+row)*HUD_ATLAS_SIZE + x], slot->bitmap.buffer + row*slot->bitmap.pitch, width);
+
+		HudGlyph& glyph = Hud.glyphs[c];
+		glyph.uv[0] = (GLfloat)x / HUD_ATLAS_SIZE;
+		glyph.uv[1] = (GLfloat)y / HUD_ATLAS_SIZE;
+		glyph.uv[2] = (GLfloat)(x + width) / HUD_ATLAS_SIZE;
+		glyph.uv[3] = (GLfloat)(y + height) / HUD_ATLAS_SIZE;
+		glyph.width = width;
+		glyph.height = height;
+		glyph.left = slot->bitmap_left;
+		glyph.top = slot->bitmap_top;
+		glyph.advance = slot->advance.x >> 6;
+		x += width + 1;
+		rowHeight = max(rowHeight, height);
+	}
+	FT_Done_Face(face);
+	FT_Done_FreeType(library);
+
+	glGenTextures(1, &Hud.AtlasID);
+	Startup.glObjects++;
+	glActiveTexture(GL_TEXTURE0 + HUD_TEXTURE_UNIT);
+	glBindTexture(GL_TEXTURE_2D, Hud.AtlasID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // rows of single bytes
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, HUD_ATLAS_SIZE, HUD_ATLAS_SIZE, 0, GL_RED, GL_UNSIGNED_BYTE, &atlas[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glActiveTexture(GL_TEXTURE0);
 
-  
-  glUseProgram(fontProgramID);
-  // Transform the text
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateText = glm::translate(glm::vec3(x,y,0));
-  glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-  Matrices.model *= (translateText * scaleText);
-  MVP = Matrices.projection * Matrices.view * Matrices.model;
-  // send font's MVP and font color to fond shaders
-  glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-  glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
+	// Every glyph is a quad - the indices never change, only the vertices are streamed
+	vector<GLushort> indices;
+	for (int g=0; g<HUD_MAX_GLYPHS; g++)
+	{
+		const int corners[6] = {0, 1, 2, 0, 2, 3};
+		for (int i=0; i<6; i++)
+			indices.push_back(g*4 + corners[i]);
+	}
+	Hud.vao = new struct VAO();
+	Hud.vao->PrimitiveMode = GL_TRIANGLES;
+	Hud.vao->FillMode = GL_FILL;
+	Hud.vao->Format = &hudVertexFormat;
+	glGenVertexArrays(1, &(Hud.vao->VertexArrayID));
+	glGenBuffers(1, &(Hud.vao->VertexBuffer));
+	glGenBuffers(1, &(Hud.vao->IndexBuffer));
+	Startup.glObjects += 3;
+	bindVertexArray(Hud.vao->VertexArrayID);
+	glBindBuffer(GL_ARRAY_BUFFER, Hud.vao->VertexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Hud.vao->IndexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+	setVertexFormat(&hudVertexFormat);
+}
 
-  // Render font
-  GL3Font.font->Render(c);
+/* Queue a string for this frame's HUD - x, y is the top left of its first line in pixels */
+void hudText (float x, float y, const string& text, const glm::vec3& color)
+{
+	float penX = x, baseline = y + Hud.ascent;
+	for (size_t i=0; i<text.size(); i++)
+	{
+		int c = (unsigned char)text[i];
+		if(c == '\n')
+		{
+			penX = x;
+			baseline += Hud.lineHeight;
+			continue;
+		}
+		if(c < 32 || c > 126)
+			c = '?';
+		const HudGlyph& glyph = Hud.glyphs[c];
+		if(glyph.width > 0 && Hud.vertices.size() < HUD_MAX_GLYPHS*4)
+		{
+			float left = penX + glyph.left, top = baseline - glyph.top;
+			float right = left + glyph.width, bottom = top + glyph.height;
+			const float corners[4][4] = {
+				{left, top, glyph.uv[0], glyph.uv[1]}, {right, top, glyph.uv[2], glyph.uv[1]},
+				{right, bottom, glyph.uv[2], glyph.uv[3]}, {left, bottom, glyph.uv[0], glyph.uv[3]} };
+			for (int k=0; k<4; k++)
+			{
+				GLfloat vertex[7] = { corners[k][0], corners[k][1], color.x, color.y, color.z, corners[k][2], corners[k][3] };
+				HudVertex v = HudVertex();
+				packVertex(&hudVertexFormat, vertex, (unsigned char*)&v);
+				Hud.vertices.push_back(v);
+			}
+		}
+		penX += glyph.advance;
+	}
+}
 
-  // font size and color changes
-  if(effect==1)
-   fontScale = (fontScale + 1) % 360;
+/* Draw every string queued this frame with one call, over the scene */
+void drawHud ()
+{
+	if(Hud.vertices.empty())
+		return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, Hud.vao->VertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, Hud.vertices.size()*sizeof(HudVertex), &Hud.vertices[0], GL_STREAM_DRAW);
+
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	polygonMode(GL_FILL);
+	useProgram(Hud.program);
+	glUniform2f(uniformLocation(Hud.program, "screenSize"), Hud.screenWidth, Hud.screenHeight);
+	glUniform1i(uniformLocation(Hud.program, "glyphAtlas"), HUD_TEXTURE_UNIT);
+	bindVertexArray(Hud.vao->VertexArrayID);
+	glDrawElements(GL_TRIANGLES, Hud.vertices.size()/4*6, GL_UNSIGNED_SHORT, (void*)0);
+	Stats.drawCalls++;
+	Stats.triangles += Hud.vertices.size()/2;
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+
+	Hud.vertices.clear();
 }
 
 /**************************
@@ -414,6 +2804,16 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
                 z_closness=20;
                 break;
 
+            case GLFW_KEY_I:
+                show_stats=!show_stats;
+                break;
+
+            case GLFW_KEY_G:
+                if(gpuCull.available)
+                    gpu_culling=!gpu_culling;
+                cout << "GPU culling " << ((gpu_culling && gpuCull.available) ? "on" : "off") << endl;
+                break;
+
             case GLFW_KEY_N:
 				 z_closness-=2;
 				break;
@@ -428,19 +2828,19 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 				break;
 
             case GLFW_KEY_UP:
-				if(z_pos>-10) z_pos-=2;
+				if(z_pos>tilePosition(0, 0).z) z_pos-=TILE_WIDTH;
 				break;
 
             case GLFW_KEY_DOWN:
-                if(z_pos<8)   z_pos+=2;
+                if(z_pos<tilePosition(board.height-1, 0).z)   z_pos+=TILE_WIDTH;
 				break;
 
 			case GLFW_KEY_LEFT:
-				if(x_pos>-10) x_pos-=2;
+				if(x_pos>tilePosition(0, 0).x) x_pos-=TILE_WIDTH;
 				break;
 
 			case GLFW_KEY_RIGHT:
-                if(x_pos<8)   x_pos+=2;
+                if(x_pos<tilePosition(0, board.width-1).x)   x_pos+=TILE_WIDTH;
 				break;				
 			default:
 				break;
@@ -497,14 +2897,57 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 	 glLoadIdentity ();
 	 gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
 	Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
+	Hud.screenWidth = fbwidth;
+	Hud.screenHeight = fbheight;
 
 }
 
 
-// Creates the rectangle object used in this sample code
-void createCube (GLfloat red, GLfloat blue, GLfloat green,float l, float b,float h,const char *c)
-{ 
-  
+// Texture coordinates start with (0,0) at top left of the image to (1,1) at bot right
+// Only the top face shows the whole image, the sides use a single texel
+const GLfloat cube_texture_buffer_data [] =
+{
+	0,1, 
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,  
+	0,1, 
+	0,1,
+	0,1,
+	0,1,
+	0,1,  // top rectangle
+	1,1,
+	1,0, //
+	0,1,
+	1,0,
+	0,0, // top rectangle ends
+	0,1,
+	0,1, 
+	0,1
+};
+
+// Fills the 36 vertices (12 triangles) of a l*b*h box with one corner at the origin
+void cubeVertexData (float l, float b, float h, GLfloat* out)
+{
    const GLfloat vertex_buffer_data [] = {
 
      0,0,0, // triangle 1 : begin
@@ -557,7 +3000,16 @@ void createCube (GLfloat red, GLfloat blue, GLfloat green,float l, float b,float
 
  };
 
-  
+  for (int i=0; i<36*3; i++)
+    out[i] = vertex_buffer_data[i];
+}
+
+// Creates the rectangle object used in this sample code
+struct VAO* createCube (GLfloat red, GLfloat blue, GLfloat green,float l, float b,float h,const char *c)
+{ 
+  GLfloat vertex_buffer_data[36*3];
+  cubeVertexData(l, b, h, vertex_buffer_data);
+
   GLfloat color_buffer_data[36*3];
   for(int i = 0; i < 36; i++)
   {
@@ -567,111 +3019,511 @@ void createCube (GLfloat red, GLfloat blue, GLfloat green,float l, float b,float
   }
 
   if(c==NULL)
-  cube[cube_key++].vao = create3DObject(GL_TRIANGLES,36, vertex_buffer_data, color_buffer_data, GL_FILL);
-  else
+   return create3DObject(GL_TRIANGLES,36, vertex_buffer_data, color_buffer_data, GL_FILL);
+
+  // Objects of the same size share VBOs, only the texture layer is their own
+  struct VAO* vao = new struct VAO(*getCubeMesh(l, b, h, vertex_buffer_data, cube_texture_buffer_data));
+  vao->TextureID = Materials.TextureID;
+  vao->TextureLayer = getTextureLayer(c);
+  return vao;
+}
+
+/* True for tiles that hide the faces of their neighbours - holes, jumpers and the outside of the board do not */
+bool solidTile (int row, int column)
+{
+  if(row<0 || column<0 || row>=board.height || column>=board.width)
+    return false;
+  const Tile& tile = board.tiles[row*board.width + column];
+  return tile.alive==1 && tile.mobile!=1;
+}
+
+/* Material layer of the tile - the crown is the last tile of the first row */
+float tileLayer (int row, int column)
+{
+  const Tile& tile = board.tiles[row*board.width + column];
+  return board.layers[(row==0 && column==board.width-1) ? 2 : (tile.mobile==1 ? 1 : 0)];
+}
+
+/* Instance data of an alive tile */
+TileInstance tileInstance (int row, int column)
+{
+  const Tile& tile = board.tiles[row*board.width + column];
+  glm::vec3 position = tilePosition(row, column);
+  TileInstance t;
+  t.offset[0] = position.x;
+  t.offset[1] = position.y;
+  t.offset[2] = position.z;
+  t.jump[0] = tile.jump;
+  t.jump[1] = (tile.mobile==1) ? JUMP_SPEED : 0;
+  t.layer = tileLayer(row, column);
+  return t;
+}
+
+/* Add the quad corner, corner+a, corner+a+b, corner+b to the chunk mesh */
+void addFace (MeshBuilder& mesh, glm::vec3 corner, glm::vec3 a, glm::vec3 b, const GLfloat uv[4][2], float layer)
+{
+  glm::vec3 p[4] = {corner, corner+a, corner+a+b, corner+b};
+  GLfloat vertices[4*6];
+  for (int i=0; i<4; i++)
   {
-	glActiveTexture(GL_TEXTURE0);
-	GLuint textureID = createTexture(c);
-	if(textureID == 0 )
-    cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-	
-	// Texture coordinates start with (0,0) at top left of the image to (1,1) at bot right
-	const GLfloat texture_buffer_data [] =
-	 {
-		0,1, 
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,  
-		0,1, 
-		0,1,
-		0,1,
-		0,1,
-		0,1,  // top rectangle
-		1,1,
-		1,0, //
-		0,1,
-		1,0,
-		0,0, // top rectangle ends
-		0,1,
-		0,1, 
-		0,1
-	};
-     cube[cube_key ++].vao= create3DTexturedObject(GL_TRIANGLES,36,vertex_buffer_data, texture_buffer_data,textureID, GL_FILL);
-}
-}
-void moveCube(int key , float x, float y,float z,float cube_rotation)
-{  glUseProgram (programID);
-
-  glm::mat4 VP = Matrices.projection * Matrices.view;
-  glm::mat4 MVP; 
+    GLfloat* v = &vertices[i*6];
+    v[0] = p[i].x; v[1] = p[i].y; v[2] = p[i].z;
+    v[3] = uv[i][0]; v[4] = uv[i][1];
+    v[5] = layer;
+  }
+  addQuad(mesh, vertices);
+}
+
+/* Top (or bottom) faces of the still tiles of the chunk - with merge, rectangles of tiles of the same
+   material become one quad, the texture repeats once per tile across it */
+void addCaps (MeshBuilder& mesh, const Chunk& chunk, int rows, int columns, bool top, bool merge)
+{
+  vector<bool> done(rows*columns, false);
+  for (int r=0; r<rows; r++)
+    for (int c=0; c<columns; c++)
+    {
+      int row = chunk.row + r, column = chunk.column + c;
+      if(done[r*columns + c] || !solidTile(row, column))
+        continue;
+      float layer = tileLayer(row, column);
+
+      // grow along the row, then add rows while the whole span matches
+      int w = 1, h = 1;
+      if(merge)
+      {
+        while(c+w < columns && !done[r*columns + c+w] && solidTile(row, column+w) && tileLayer(row, column+w) == layer)
+          w++;
+        for (bool grow=true; grow && r+h < rows; )
+        {
+          for (int k=0; k<w && grow; k++)
+            grow = !done[(r+h)*columns + c+k] && solidTile(row+h, column+k) && tileLayer(row+h, column+k) == layer;
+          if(grow)
+            h++;
+        }
+      }
+      for (int i=0; i<h; i++)
+        for (int k=0; k<w; k++)
+          done[(r+i)*columns + c+k] = true;
+
+      glm::vec3 corner = tilePosition(row, column) + glm::vec3(0, top ? TILE_HEIGHT : 0, 0);
+      glm::vec3 a(w*TILE_WIDTH, 0, 0), b(0, 0, h*TILE_WIDTH);
+      if(top)
+      {
+        // same mapping as the top of cube_texture_buffer_data, repeated w x h times
+        const GLfloat uv[4][2] = { {(GLfloat)h, 0}, {(GLfloat)h, (GLfloat)w}, {0, (GLfloat)w}, {0, 0} };
+        addFace(mesh, corner, a, b, uv, layer);
+      }
+      else
+      {
+        const GLfloat uv[4][2] = { {0,1}, {0,1}, {0,1}, {0,1} };
+        addFace(mesh, corner, b, a, uv, layer);
+      }
+    }
+}
+
+/* Replace a chunk mesh with the new geometry - an empty mesh leaves NULL */
+void replaceMesh (struct VAO*& vao, const MeshBuilder& mesh)
+{
+  if(vao != NULL)
+    delete3DObject(vao);
+  vao = NULL;
+  if(mesh.indices.empty())
+    return;
+  vao = create3DIndexedObject(GL_TRIANGLES, mesh, GL_FILL);
+  vao->TextureID = Materials.TextureID;
+}
+
+/* Rebuild the meshes of a chunk - still tiles only keep the side faces that are not against another still tile,
+   jumpers move so they are drawn as whole cubes */
+void buildChunk (Chunk& chunk)
+{
+  MeshBuilder mesh;
+  initMesh(mesh, &boardVertexFormat);
+  vector<TileInstance> instances;
+  chunk.numTiles = 0;
+
+  int rows = min(CHUNK_SIZE, board.height - chunk.row), columns = min(CHUNK_SIZE, board.width - chunk.column);
+  const GLfloat side_uv[4][2] = { {0,1}, {0,1}, {0,1}, {0,1} }; // cube sides use a single texel
+  glm::vec3 up(0, TILE_HEIGHT, 0), across(TILE_WIDTH, 0, 0), along(0, 0, TILE_WIDTH);
+  for (int r=chunk.row; r<chunk.row+rows; r++)
+    for (int c=chunk.column; c<chunk.column+columns; c++)
+    {
+      const Tile& tile = board.tiles[r*board.width + c];
+      if(tile.alive!=1)
+        continue;
+      chunk.numTiles++;
+      glm::vec3 position = tilePosition(r, c);
+
+      if(tile.mobile==1)
+      {
+        instances.push_back(tileInstance(r, c));
+        continue;
+      }
+
+      float layer = tileLayer(r, c);
+      if(!solidTile(r, c-1))
+        addFace(mesh, position, along, up, side_uv, layer);
+      if(!solidTile(r, c+1))
+        addFace(mesh, position+across, up, along, side_uv, layer);
+      if(!solidTile(r-1, c))
+        addFace(mesh, position, up, across, side_uv, layer);
+      if(!solidTile(r+1, c))
+        addFace(mesh, position+along, across, up, side_uv, layer);
+    }
+  addCaps(mesh, chunk, rows, columns, true, board.mergeTops);
+  addCaps(mesh, chunk, rows, columns, false, board.mergeTops);
+
+  replaceMesh(chunk.lods[0], mesh);
+
+  // LOD 1 - a heightfield of merged tops, the sides of holes and jumpers are dropped
+  initMesh(mesh, &boardVertexFormat);
+  addCaps(mesh, chunk, rows, columns, true, true);
+  glm::vec3 first = tilePosition(chunk.row, chunk.column), end = tilePosition(chunk.row+rows, chunk.column+columns);
+  glm::vec3 width(end.x - first.x, 0, 0), depth(0, 0, end.z - first.z);
+  float land = board.layers[0];
+  if(chunk.column == 0)
+    addFace(mesh, first, depth, up, side_uv, land);
+  if(chunk.column + columns == board.width)
+    addFace(mesh, first+width, up, depth, side_uv, land);
+  if(chunk.row == 0)
+    addFace(mesh, first, up, width, side_uv, land);
+  if(chunk.row + rows == board.height)
+    addFace(mesh, first+depth, width, up, side_uv, land);
+  replaceMesh(chunk.lods[1], mesh);
+
+  // LOD 2 - a single land slab, holes and jumpers are too small to see
+  initMesh(mesh, &boardVertexFormat);
+  const GLfloat top_uv[4][2] = { {(GLfloat)rows, 0}, {(GLfloat)rows, (GLfloat)columns}, {0, (GLfloat)columns}, {0, 0} };
+  addFace(mesh, first+up, width, depth, top_uv, land);
+  addFace(mesh, first, depth, up, side_uv, land);
+  addFace(mesh, first+width, up, depth, side_uv, land);
+  addFace(mesh, first, up, width, side_uv, land);
+  addFace(mesh, first+depth, width, up, side_uv, land);
+  replaceMesh(chunk.lods[2], mesh);
+
+  setInstances(chunk.jumpers, instances.empty() ? NULL : &instances[0], instances.size());
+  chunk.solid = (chunk.numTiles == rows*columns);
+  chunk.dirty = false;
+}
+
+/* Change one tile - its chunk, and the chunks whose faces it hides, are rebuilt before the next draw.
+   Nothing edits the board during play yet, this is the hook for whatever does */
+void setTile (int row, int column, const Tile& tile)
+{
+  board.tiles[row*board.width + column] = tile;
+  const int neighbours[5][2] = { {0,0}, {-1,0}, {1,0}, {0,-1}, {0,1} };
+  for (int i=0; i<5; i++)
+  {
+    int r = row + neighbours[i][0], c = column + neighbours[i][1];
+    if(r>=0 && c>=0 && r<board.height && c<board.width)
+      board.chunks[(r/CHUNK_SIZE)*board.chunkColumns + c/CHUNK_SIZE].dirty = true;
+  }
+  gpuCull.dirty = true;
+}
+
+/* Set up the compute culling of the board when the context can run it */
+void initGPUCulling ()
+{
+  // GL 4.3 has everything in core, its extension strings are not guaranteed. Below that the
+  // extensions are needed, and glMemoryBarrier comes with ARB_shader_image_load_store before 4.2
+  bool core = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 3);
+  bool core42 = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 2);
+  bool extensions = GLAD_GL_ARB_compute_shader && GLAD_GL_ARB_shader_storage_buffer_object && GLAD_GL_ARB_draw_indirect
+                    && (core42 || (GLAD_GL_ARB_shader_image_load_store && GLAD_GL_ARB_shading_language_420pack));
+  gpuCull.available = (core || extensions)
+                      && loadCoreProc(glad_glDispatchCompute, "glDispatchCompute", 4, 3)
+                      && loadCoreProc(glad_glMemoryBarrier, "glMemoryBarrier", 4, 2)
+                      && loadCoreProc(glad_glDrawElementsIndirect, "glDrawElementsIndirect", 4, 0);
+  if(!gpuCull.available)
+  {
+    cout << "GPU culling unavailable - needs GL 4.3 or ARB_compute_shader, ARB_shader_storage_buffer_object, ARB_draw_indirect"
+         << " and (below 4.2) ARB_shader_image_load_store and ARB_shading_language_420pack" << endl;
+    return;
+  }
+  for (int i=0; i<2; i++)
+    glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, i, &gpuCull.maxGroups[i]);
+
+  // only submitted - it is finished the first time the board is culled with it
+  gpuCull.program = createComputeProgram("BoardCull.comp");
+
+  glGenBuffers(1, &gpuCull.TileBuffer);
+  glGenBuffers(1, &gpuCull.IndirectBuffer);
+  Startup.glObjects += 2;
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpuCull.IndirectBuffer);
+  glBufferData(GL_DRAW_INDIRECT_BUFFER, 5*sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+
+  gpuCull.vao = create3DInstancedObject(board.mesh);
+  gpuCull.vao->IndirectBuffer = gpuCull.IndirectBuffer;
+  gpuCull.vao->Animated = true; // the visible tiles are only known on the GPU
+  gpuCull.dirty = true;
+}
+
+/* Upload every alive tile, and make room for all of them in the visible list */
+void fillGPUTiles ()
+{
+  vector<TileInstance> tiles;
+  for (int r=0; r<board.height; r++)
+    for (int c=0; c<board.width; c++)
+      if(board.tiles[r*board.width + c].alive==1)
+        tiles.push_back(tileInstance(r, c));
+  gpuCull.numTiles = tiles.size();
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuCull.TileBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, tiles.size()*sizeof(TileInstance), tiles.empty() ? NULL : &tiles[0], GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, gpuCull.vao->InstanceBuffer);
+  glBufferData(GL_ARRAY_BUFFER, tiles.size()*sizeof(TileInstance), NULL, GL_DYNAMIC_COPY);
+  gpuCull.dirty = false;
+}
+
+/* Cull every tile against the view frustum on the GPU - the visible ones are packed into the instance buffer
+   of gpuCull.vao and their number goes straight into its indirect draw. False when the board is drawn
+   by the CPU path instead */
+bool cullBoardOnGPU ()
+{
+  if(!finishProgram(gpuCull.program)->Linked)
+  {
+    gpuCull.available = false; // finishProgram printed why
+    cout << "GPU culling off" << endl;
+    return false;
+  }
+  if(gpuCull.dirty)
+    fillGPUTiles();
+  GLuint groups = (gpuCull.numTiles + 63) / 64;
+  GLuint columns = max(min(groups, (GLuint)gpuCull.maxGroups[0]), 1u);
+  if((groups + columns-1) / columns > (GLuint)gpuCull.maxGroups[1])
+    return false; // more tiles than one dispatch can cover
+
+  const GLuint command[5] = { (GLuint)board.mesh->NumIndices, 0, 0, 0, 0 }; // count, instanceCount, firstIndex, baseVertex, baseInstance
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpuCull.IndirectBuffer);
+  glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(command), command);
+  if(gpuCull.numTiles == 0)
+    return true;
+
+  ShaderProgram* program = gpuCull.program;
+  useProgram(program);
+  glUniform1ui(uniformLocation(program, "numTiles"), gpuCull.numTiles);
+  glUniform4fv(uniformLocation(program, "planes"), 6, &viewFrustum.planes[0][0]);
+  glUniform3f(uniformLocation(program, "tileSize"), TILE_WIDTH, TILE_HEIGHT + JUMP_HEIGHT, TILE_WIDTH);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gpuCull.TileBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gpuCull.vao->InstanceBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gpuCull.IndirectBuffer);
+  // one invocation per tile, in rows of at most maxGroups[0] groups
+  glDispatchCompute(columns, (groups + columns-1) / columns, 1);
+
+  // the instances and the draw command are read by the next draw
+  glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+  return true;
+}
+
+// Creates the shared tile mesh and the chunks of board.tiles - they are meshed on their first draw
+void createBoard (const char *land, const char *jumper, const char *crown)
+{
+  GLfloat vertex_buffer_data[36*3];
+  cubeVertexData(TILE_WIDTH, TILE_HEIGHT, TILE_WIDTH, vertex_buffer_data);
+  board.mesh = create3DTexturedObject(GL_TRIANGLES, 36, vertex_buffer_data, cube_texture_buffer_data, Materials.TextureID, GL_FILL);
+
+  const char *files[3] = {land, jumper, crown};
+  for (int t=0; t<3; t++)
+    board.layers[t] = getTextureLayer(files[t]);
+
+  int chunkRows = (board.height + CHUNK_SIZE-1) / CHUNK_SIZE;
+  board.chunkColumns = (board.width + CHUNK_SIZE-1) / CHUNK_SIZE;
+  board.chunks.resize(chunkRows * board.chunkColumns);
+  for (int r=0; r<chunkRows; r++)
+    for (int c=0; c<board.chunkColumns; c++)
+    {
+      Chunk& chunk = board.chunks[r*board.chunkColumns + c];
+      chunk.row = r*CHUNK_SIZE;
+      chunk.column = c*CHUNK_SIZE;
+      int last_row = min(chunk.row + CHUNK_SIZE, board.height) - 1;
+      int last_column = min(chunk.column + CHUNK_SIZE, board.width) - 1;
+      chunk.min = tilePosition(chunk.row, chunk.column);
+      chunk.max = tilePosition(last_row, last_column) + glm::vec3(TILE_WIDTH, TILE_HEIGHT + JUMP_HEIGHT, TILE_WIDTH);
+      for (int l=0; l<NUM_LODS; l++)
+        chunk.lods[l] = NULL;
+      chunk.jumpers = create3DInstancedObject(board.mesh);
+      chunk.numTiles = 0;
+      chunk.solid = false;
+      chunk.dirty = true;
+    }
+  initGPUCulling();
+}
+
+/* Add a box of scenery - nothing is created until buildStaticBatch */
+void addStaticBox (const glm::vec3& min, const glm::vec3& max, const char* material)
+{
+  scenery.boxMin.push_back(min);
+  scenery.boxMax.push_back(max);
+  scenery.layers.push_back(getTextureLayer(material));
+}
+
+/* Bake every static box into one world space mesh - same faces and texture coords as createCube */
+void buildStaticBatch ()
+{
+  MeshBuilder mesh;
+  initMesh(mesh, &boardVertexFormat);
+  for (size_t b=0; b<scenery.boxMin.size(); b++)
+  {
+    glm::vec3 size = scenery.boxMax[b] - scenery.boxMin[b];
+    GLfloat vertex_buffer_data[36*3];
+    cubeVertexData(size.x, size.y, size.z, vertex_buffer_data);
+    for (int v=0; v<36; v++)
+    {
+      GLfloat vertex[6];
+      for (int i=0; i<3; i++)
+        vertex[i] = vertex_buffer_data[v*3 + i] + scenery.boxMin[b][i];
+      vertex[3] = cube_texture_buffer_data[v*2];
+      vertex[4] = cube_texture_buffer_data[v*2 + 1];
+      vertex[5] = scenery.layers[b];
+      addVertex(mesh, vertex);
+    }
+  }
+  scenery.vao = create3DIndexedObject(GL_TRIANGLES, mesh, GL_FILL);
+  scenery.vao->TextureID = Materials.TextureID;
+}
+
+/* The leanest scene shader variant for a VAO - what its vertices and instances carry decides */
+ShaderProgram* programFor (const struct VAO* vao)
+{
+  bool perVertexLayer = false, textured = (vao->TextureID != 0);
+  for (int i=0; i<vao->Format->NumAttribs; i++)
+  {
+    perVertexLayer |= (vao->Format->Attribs[i].Index == 5);
+    textured |= (vao->Format->Attribs[i].Index == 2);
+  }
+  bool instanced = (vao->InstanceBuffer != 0);
+  int features = textured ? SHADER_TEXTURED : 0;
+  if(instanced)
+    features |= SHADER_INSTANCED | (vao->Animated ? SHADER_ANIMATED : 0);
+  else if(!perVertexLayer)
+    features |= SHADER_OBJECT;
+  return sceneProgram(features);
+}
+
+/* All the static scenery in one draw */
+void drawScenery ()
+{
+  submitObject(programFor(scenery.vao), glm::mat4(1.0f), scenery.vao);
+}
+
+void moveCube(struct VAO* vao , float x, float y,float z,float cube_rotation)
+{
   Matrices.model = glm::mat4(1.0f);
 
   glm::mat4 translateRec = glm::translate (glm::vec3(x, y, z)); // glTranslatef
   glm::mat4 rotateRec = glm::rotate((float)(cube_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
   Matrices.model *= (translateRec * rotateRec); 
-  MVP = VP * Matrices.model;
 
   //  Don't change unless you are sure!!
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(cube[key].vao);
-   
+  submitObject(programFor(vao), Matrices.model, vao);
 }
 
-void handle_jump(int key)
- {
-   if(cube[key].jump<=3)
-	cube[key].jump+=0.01;
-   else
-	cube[key].jump=0;
-
-  }
-
-void move_Text_Cube(int key , float x, float y,float z,float cube_rotation)
+void move_Text_Cube(struct VAO* vao , float x, float y,float z,float cube_rotation)
 {
-	glUseProgram(textureProgramID);
-
-  glm::mat4 VP = Matrices.projection * Matrices.view;
-  glm::mat4 MVP; 
   Matrices.model = glm::mat4(1.0f);
 
   glm::mat4 translateRec = glm::translate (glm::vec3(x, y, z)); // glTranslatef
   
-   if(cube[key].mobile==1 && key!=100)
-  	 {handle_jump(key);
-  	 translateRec = glm::translate (glm::vec3(x,cube[key].jump, z)); // glTranslatef
-     }
   glm::mat4 rotateRec = glm::rotate((float)(cube_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
   Matrices.model *= (translateRec * rotateRec); 
-  MVP = VP * Matrices.model;
 
+   submitObject(programFor(vao), Matrices.model, vao);
+}
+
+/* Distance between the camera and the closest point of the chunk */
+float chunkDistance (const Chunk& chunk)
+{
+  glm::vec3 closest = glm::min(glm::max(Matrices.eye, chunk.min), chunk.max);
+  return glm::distance(Matrices.eye, closest);
+}
 
-   glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-   glUseProgram(textureProgramID);
-   glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-   draw3DTexturedObject(cube[key].vao);	
- 
+/* Level of detail of a chunk from its distance to the camera */
+int chunkLod (const Chunk& chunk)
+{
+  float distance = chunkDistance(chunk);
+  if(distance < lod_near)
+    return 0;
+  return (distance < lod_far) ? 1 : 2;
+}
+
+/* The static scenery and the nearest chunks without holes are drawn into the occlusion buffer */
+#define MAX_OCCLUDERS 16
+
+void rasterizeOccluders (const vector<int>& visibleChunks)
+{
+  clearOcclusion(Matrices.projection * Matrices.view);
+  for (size_t b=0; b<scenery.boxMin.size(); b++)
+    rasterizeOccluder(scenery.boxMin[b], scenery.boxMax[b]);
+
+  vector< pair<float, int> > nearest;
+  for (size_t i=0; i<visibleChunks.size(); i++)
+    if(board.chunks[visibleChunks[i]].solid)
+      nearest.push_back(make_pair(chunkDistance(board.chunks[visibleChunks[i]]), visibleChunks[i]));
+  int count = min((int)nearest.size(), MAX_OCCLUDERS);
+  partial_sort(nearest.begin(), nearest.begin() + count, nearest.end());
+  for (int i=0; i<count; i++)
+  {
+    // jumpers may leave a gap below JUMP_HEIGHT, above TILE_HEIGHT only some of them reach
+    const Chunk& chunk = board.chunks[nearest[i].second];
+    rasterizeOccluder(glm::vec3(chunk.min.x, JUMP_HEIGHT, chunk.min.z), glm::vec3(chunk.max.x, TILE_HEIGHT, chunk.max.z));
+  }
 }
 
+/* Draws every chunk in the view frustum - one call for its still tiles and one instanced call for its jumpers */
+/* Jumpers are animated by the vertex shader - only chunks with a changed tile are rebuilt */
+void drawBoard()
+{
+  if(gpu_culling && gpuCull.available && cullBoardOnGPU())
+  {
+    submitDraw(programFor(gpuCull.vao), glm::mat4(1.0f), gpuCull.vao);
+    return;
+  }
+
+  vector<int> visibleChunks;
+  for (size_t c=0; c<board.chunks.size(); c++)
+  {
+    Chunk& chunk = board.chunks[c];
+    if(chunk.dirty)
+      buildChunk(chunk);
+
+    if(!boxInFrustum(viewFrustum, chunk.min, chunk.max))
+      Stats.culled += chunk.numTiles;
+    else
+      visibleChunks.push_back(c);
+  }
+
+  if(occlusion_culling)
+  {
+    double start = glfwGetTime();
+    rasterizeOccluders(visibleChunks);
+    Stats.occluderTime += (glfwGetTime() - start) * 1000;
+  }
 
+  for (size_t i=0; i<visibleChunks.size(); i++)
+  {
+    Chunk& chunk = board.chunks[visibleChunks[i]];
+    if(occlusion_culling)
+    {
+      double start = glfwGetTime();
+      bool occluded = boxOccluded(chunk.min, chunk.max);
+      Stats.occlusionTestTime += (glfwGetTime() - start) * 1000;
+      if(occluded)
+      {
+        Stats.culled += chunk.numTiles;
+        Stats.occluded++;
+        continue;
+      }
+    }
+
+    Stats.visible += chunk.numTiles;
+    int lod = chunkLod(chunk);
+    Stats.lodChunks[lod]++;
+    if(chunk.lods[lod] != NULL)
+      submitDraw(programFor(chunk.lods[lod]), glm::mat4(1.0f), chunk.lods[lod]);
+    if(lod < 2 && chunk.jumpers->NumInstances > 0)
+      submitDraw(programFor(chunk.jumpers), glm::mat4(1.0f), chunk.jumpers);
+  }
+}
 
 
 /* Render the scene with openGL */
@@ -680,8 +3532,6 @@ void draw()
 {
   // clear the color and depth in the frame buffer
   glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  // use the loaded shader program
-  glUseProgram (programID);
   // glm::vec4(0,0,10,1);
   // glm::mat4 rotate = glm::rotate((float)(x_theta*M_PI/180.0f), glm::vec3(1,0,0)); // rotate about vector (-1,1,1)
   // Eye - Location of camera. Don't change unless you are sure!!
@@ -697,6 +3547,7 @@ void draw()
   if(cam_mode==0)
   {
   glm::vec3 eye ( x, y, z );
+  Matrices.eye = eye;
   // Target - Where is the camera looking at.  Don't change unless you are sure!!
   glm::vec3 target (0, 0, 0);
   // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
@@ -708,6 +3559,7 @@ void draw()
   if(cam_mode==1)
    { 
   glm::vec3 eye ( x_pos, y+3, z_pos+3 );
+  Matrices.eye = eye;
   // Target - Where is the camera looking at.  Don't change unless you are sure!!
   glm::vec3 target (x_pos, 8, z_pos);
   // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
@@ -717,6 +3569,18 @@ void draw()
   Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
    }
 
+  // Send the camera to every program at once - it is the first block of this frame's part of the ring
+  beginRingFrame();
+  GLintptr offset;
+  CameraBlock* camera = (CameraBlock*)ringAlloc(sizeof(CameraBlock), offset);
+  camera->projection = Matrices.projection;
+  camera->view = Matrices.view;
+  glm::mat4 VP = Matrices.projection * Matrices.view; // the ring is write only, the frustum is built from this copy
+  camera->VP = VP;
+  camera->time = glfwGetTime();
+  extractFrustum(viewFrustum, VP);
+  flushRing();
+  glBindBufferRange(GL_UNIFORM_BUFFER, CAMERA_BINDING, Ring.Buffer, offset, sizeof(CameraBlock));
 
 }
 
@@ -731,12 +3595,18 @@ GLFWwindow* initGLFW (int width, int height)
 		exit(EXIT_FAILURE);
 	}
 
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	// GL 4.3 runs the compute culling of the board - everything else only needs 3.3
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 	window = glfwCreateWindow(width, height, "BOARD GAME", NULL, NULL);
+	if (!window) {
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(width, height, "BOARD GAME", NULL, NULL);
+	}
 
 	if (!window) {
 		glfwTerminate();
@@ -772,14 +3642,23 @@ void initGL (GLFWwindow* window, int width, int height)
 {
 	
 
-	// Create and compile our GLSL program from the texture shaders
-	textureProgramID = LoadShaders( "TextureRender.vert", "TextureRender.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.TexMatrixID = glGetUniformLocation(textureProgramID, "MVP");
-	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL3.vert", "Sample_GL3.frag" ); // HALA
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	// Uniform buffer holding the camera and the objects of the last frames
+	initUploadRing();
+
+	{
+	ScopedPhase phase("shaders");
+	// Every program is submitted up front, the driver compiles them while the fonts and the
+	// materials load - each one is only waited for when it is first used
+	// The scene shader variants the game draws with - any other one is built when a draw asks for it
+	sceneProgram(SHADER_TEXTURED | SHADER_OBJECT);                     // textured objects
+	sceneProgram(SHADER_TEXTURED);                                     // board chunks and scenery
+	sceneProgram(SHADER_TEXTURED | SHADER_INSTANCED | SHADER_ANIMATED); // jumping tiles
+	// Create and compile our GLSL program from the font shaders
+	// The captured outputs are what the text cache keeps of a rendered string
+	const char* fontCapture[] = { "capturedPosition", "capturedNormal" };
+	fontProgram = createShaderProgram( "fontrender.vert", "fontrender.frag", fontCapture, 2 );
+	Hud.program = createShaderProgram( "HudText.vert", "HudText.frag" );
+	}
 
 	reshapeWindow (window, width, height);
 
@@ -793,8 +3672,11 @@ void initGL (GLFWwindow* window, int width, int height)
 	// glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	// Initialise FTGL stuff
+	ScopedPhase fonts("fonts");
 	const char* fontfile = "arial.ttf";
-	GL3Font.font = new FTExtrudeFont(fontfile); // 3D extrude style rendering
+	static Asset font; // FreeType reads the glyphs from it for as long as the fonts live
+	loadAsset(fontfile, font);
+	GL3Font.font = new FTExtrudeFont(font.data, font.size); // 3D extrude style rendering
 
 	if(GL3Font.font->Error())
 	{
@@ -803,21 +3685,15 @@ void initGL (GLFWwindow* window, int width, int height)
 		exit(EXIT_FAILURE);
 	}
 
-	// Create and compile our GLSL program from the font shaders
-	fontProgramID = LoadShaders( "fontrender.vert", "fontrender.frag" );
-	GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
-	fontVertexCoordAttrib = glGetAttribLocation(fontProgramID, "vertexPosition");
-	fontVertexNormalAttrib = glGetAttribLocation(fontProgramID, "vertexNormal");
-	fontVertexOffsetUniform = glGetUniformLocation(fontProgramID, "pen");
-	GL3Font.fontMatrixID = glGetUniformLocation(fontProgramID, "MVP");
-	GL3Font.fontColorID = glGetUniformLocation(fontProgramID, "fontColor");
-
-	GL3Font.font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
+	// FTGL gets the locations of the font program when it first renders - see useFontProgram
 	GL3Font.font->FaceSize(1);
 	GL3Font.font->Depth(0);
 	GL3Font.font->Outset(0, 0);
 	GL3Font.font->CharMap(ft_encoding_unicode);
 
+	// 2D text goes through the glyph atlas instead
+	initHud(fontfile, font);
+
 	cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
 	cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
 	cout << "VERSION: " << glGetString(GL_VERSION) << endl;
@@ -827,62 +3703,160 @@ void initGL (GLFWwindow* window, int width, int height)
   
 int main (int argc, char** argv)
 {
+	Startup.start = chrono::steady_clock::now();
+	Startup.firstFrame = -1;
 	int width = 1300;
 	int height = 600;
-    GLFWwindow* window = initGLFW(width, height);
+
+	// --board WIDTHxHEIGHT picks the number of tiles
+	for (int i=1; i<argc; i++)
+	{
+		if(string(argv[i]) == "--board" && i+1 < argc)
+		{
+			if(sscanf(argv[++i], "%dx%d", &board_width, &board_height) != 2 || board_width < 2 || board_height < 2)
+			{
+				cout << "Usage: " << argv[0] << " [--board WIDTHxHEIGHT] [--no-merge] [--lod NEAR,FAR] [--no-occlusion] [--pack] [--goal-label] [--verify-assets] [--startup-report FILE] [--compare-startup] - at least 2x2 tiles" << endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if(string(argv[i]) == "--no-merge")
+			merge_tops = false;
+		else if(string(argv[i]) == "--no-occlusion")
+			occlusion_culling = false;
+		else if(string(argv[i]) == "--pack")
+		{
+			packBundle();
+			exit(EXIT_SUCCESS);
+		}
+		else if(string(argv[i]) == "--goal-label")
+			goal_label = true;
+		else if(string(argv[i]) == "--verify-assets")
+			verify_assets = true;
+		else if(string(argv[i]) == "--startup-report" && i+1 < argc)
+			startup_report = argv[++i];
+		else if(string(argv[i]) == "--compare-startup")
+		{
+			compareStartups(argc, argv);
+			exit(EXIT_SUCCESS);
+		}
+		else if(string(argv[i]) == "--lod" && i+1 < argc)
+		{
+			if(sscanf(argv[++i], "%f,%f", &lod_near, &lod_far) != 2 || lod_near > lod_far)
+			{
+				cout << "Usage: " << argv[0] << " [--board WIDTHxHEIGHT] [--no-merge] [--lod NEAR,FAR] [--no-occlusion] [--pack] [--goal-label] [--verify-assets] [--startup-report FILE] [--compare-startup] - NEAR is at most FAR" << endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+    GLFWwindow* window;
+    {
+    ScopedPhase phase("bundle");
+    openBundle(); // one file for every asset when it has been packed
+    }
+    {
+    ScopedPhase phase("window");
+    window = initGLFW(width, height);
+    }
+    {
+    ScopedPhase phase("gl");
     initGL (window, width, height);
+    }
  
-    int x=0;
 	char land[]="land.jpeg" ,player[20]="player.jpeg",water[20]="water.jpeg",jumper[20]="jumper.jpeg";
 	char last[]="last.jpeg";
+	// Every texture of the scene is packed into one texture array up front
+	const char* materials[] = {land, jumper, last, player, water};
+	{
+	ScopedPhase phase("materials");
+	createMaterials(materials, 5);
+	}
 	// 		MAKE BOARD
-    for(int i =0;i<10;i++)
-    	for (int j=0;j<10;j++)
+	{
+	ScopedPhase phase("board");
+    board.width = board_width;
+    board.height = board_height;
+    board.mergeTops = merge_tops;
+    board.tiles.resize(board.width * board.height);
+    int start = (board.height-1) * board.width, goal = board.width-1; // bottom left and top right tiles
+    for(int x=0; x<board.width*board.height; x++)
     	  {
-    	  if(rand()%10==9 && x!=90 && x!=9) // SET some cubes to be holes // avoid cube 10 ,which is the starting point
-    	  	cube[x].alive=0;
+    	  Tile& tile = board.tiles[x];
+    	  if(rand()%10==9 && x!=start && x!=goal) // SET some cubes to be holes // avoid the starting point and the crown
+    	  	tile.alive=0;
           else
-            cube[x].alive=1;              
-          if (x==9)
-          	 createCube(0,0,0,2,8,2,&last[0]); // use normal texture
-          else if(rand()%8==7 && x!=90) // SET some jumping cubes    // avoid cube 10 ,which is the starting point
+            tile.alive=1;              
+          if (x!=goal && rand()%8==7 && x!=start) // SET some jumping cubes    // avoid the starting point and the crown
            {
-           	cube[x].mobile=1;
-           	cube[x].jump=rand()%3;
-            createCube(0,0,0,2,8,2,&jumper[0]); // use jumper texture
+           	tile.mobile=1;
+           	tile.jump=rand()%3;
            }
-          else
-             createCube(0,0,0,2,8,2,&land[0]);	
-          x++;
 	      }
+    createBoard(&land[0], &jumper[0], &last[0]); // all tiles share one mesh
+    x_pos = tilePosition(board.height-1, 0).x;
+    z_pos = tilePosition(board.height-1, 0).z;
+	}
 
-    createCube(0,0,0,2,1,2,&player[0]); // PLAYER  
-     cube[100].mobile=0;
-	createCube(0,0,0,6,8,20,&water[0]); // WATER
-	createCube(0,0,0,6,8,20,&water[0]); // WATER
-	createCube(0,0,0,32,8,6,&water[0]); // WATER
-	createCube(0,0,0,32,8,6,&water[0]); // WATER
+	{
+	ScopedPhase phase("scenery");
+    player_cube.vao = createCube(0,0,0,2,1,2,&player[0]); // PLAYER  
+    // WATER - a slab along every side of the board
+    glm::vec3 first = tilePosition(0, 0), end = tilePosition(board.height, board.width);
+    float length = end.x - first.x + 12, depth = end.z - first.z;
+	addStaticBox(glm::vec3(first.x-6, 0, first.z), glm::vec3(first.x, 8, first.z+depth), &water[0]);
+	addStaticBox(glm::vec3(end.x, 0, first.z), glm::vec3(end.x+6, 8, first.z+depth), &water[0]);
+	addStaticBox(glm::vec3(first.x-6, 0, first.z-6), glm::vec3(first.x-6+length, 8, first.z), &water[0]);
+	// the near slab starts after the last row - it used to cover that row's tiles (z 8..14 on 10x10)
+	addStaticBox(glm::vec3(first.x-6, 0, end.z), glm::vec3(first.x-6+length, 8, end.z+6), &water[0]);
+	buildStaticBatch(); // still board tiles are baked per chunk by createBoard
+	}
+	printResourceStats();
+	// the first frame and the background materials end inside the loop, so they are timed by hand
+	Startup.firstFrame = beginPhase("first frame");
 	while (!glfwWindowShouldClose(window)) {
+		streamMaterials(); // real images replace the placeholders as they are decoded
 		draw();
-		move_Text_Cube(101,-16,0,-10,0);// water
-		move_Text_Cube(102,10,0,-10,0);// water
-		move_Text_Cube(103,-16,0,-16,0);// water
-        move_Text_Cube(104,-16,0,8,0);// water
+		drawScenery(); // water
 
-		move_Text_Cube(100,x_pos,8,z_pos,0); //player
+		move_Text_Cube(player_cube.vao,x_pos,8,z_pos,0); //player
 		//board
-		 x=0;
-		for(int i=-5;i<5;i++)
-			for (int j=-5;j<5;j++)
-			{   if(cube[x].alive==1)
-                move_Text_Cube(x,j*2,0,i*2,0);
-                x++;
-			}
-	// char h[]="sdgdgdg";		
-    // drawFont(&h[0],-3,5,3,1,0);		
+		drawBoard();
+		flushRenderQueue();
+    // the crown tile can be labelled with cached 3D text
+    if(goal_label)
+        drawText3D("GOAL", tilePosition(0, board.width-1) + glm::vec3(-2, TILE_HEIGHT + JUMP_HEIGHT + 2, TILE_WIDTH/2), 3, 0.5f, glm::vec3(1, 0.8f, 0));
+    double hud_start = glfwGetTime();
+    ostringstream timer;
+    timer << "Time: " << (int)glfwGetTime() << " s";
+    hudText(10, 10, timer.str(), glm::vec3(1, 1, 1));
+    if(show_stats)
+        hudText(10, 10 + Hud.lineHeight, stats_text, glm::vec3(1, 1, 0));
+    drawHud();
+    Stats.hudTime += (glfwGetTime() - hud_start) * 1000;
+    endRingFrame();
     glfwSwapBuffers(window);
+    if(Startup.firstFrame >= 0)
+    {
+        glFinish(); // the first frame counts once it is on screen
+        endPhase(Startup.firstFrame);
+        Startup.firstFrame = -1;
+    }
+    // Startup is over once every material is in as well
+    if(!Startup.reported && Loader.workers.empty())
+    {
+        Startup.reported = true;
+        printStartupReport();
+        if(startup_report)
+        {
+            bool written = writeStartupReport(startup_report);
+            glfwTerminate();
+            exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    reportFrameStats();
     glfwPollEvents();
 	}
+    joinMaterialWorkers();
     glfwTerminate();
 	exit(EXIT_SUCCESS);
 }